@@ -0,0 +1,165 @@
+#include "cpuaffinity.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+static const char* kSysCpuDir = "/sys/devices/system/cpu/";
+static const char* kSysNodeDir = "/sys/devices/system/node/";
+//linux/mempolicy.h
+static const int kMpolPreferred = 1;
+
+//解析"0-3,8,10-11"格式的CPU列表
+static std::vector<int> ParseCpuList(const std::string& text)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty() || item == "\n") {
+            continue;
+        }
+        size_t dash = item.find('-');
+        int first = std::atoi(item.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+        for (int c = first; c <= last; c++) {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+static bool ReadFile(const std::string& path, std::string& text)
+{
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::getline(in, text);
+    return true;
+}
+
+static int ReadInt(const std::string& path, int def)
+{
+    std::string text;
+    return ReadFile(path, text) ? std::atoi(text.c_str()) : def;
+}
+
+int CpuNumaNode(int cpu)
+{
+    std::string text;
+    if (ReadFile(std::string(kSysNodeDir) + "possible", text)) {
+        std::vector<int> nodes = ParseCpuList(text);
+        for (int node : nodes) {
+            std::string cpulist;
+            if (!ReadFile(std::string(kSysNodeDir) + "node" + std::to_string(node) + "/cpulist", cpulist)) {
+                continue;
+            }
+            std::vector<int> cpus = ParseCpuList(cpulist);
+            if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+                return node;
+            }
+        }
+    }
+    return -1;
+}
+
+//去掉进程不允许使用的CPU(taskset、cgroup cpuset、容器等限制)，否则绑定会失败
+static void KeepAllowedCpus(std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&allowed](int cpu) {
+        return cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed);
+    }), cpus.end());
+#endif
+}
+
+std::vector<int> DefaultWorkerCpus()
+{
+    std::string text;
+    std::vector<int> online;
+    if (ReadFile(std::string(kSysCpuDir) + "online", text)) {
+        online = ParseCpuList(text);
+    }
+    if (online.empty()) {
+        for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++) {
+            online.push_back(c);
+        }
+        KeepAllowedCpus(online);
+        return online;
+    }
+    KeepAllowedCpus(online);
+    //每个物理核(package, core_id)只取编号最小的逻辑CPU
+    std::map<std::pair<int, int>, int> cores;
+    for (int cpu : online) {
+        std::string topo = std::string(kSysCpuDir) + "cpu" + std::to_string(cpu) + "/topology/";
+        int package = ReadInt(topo + "physical_package_id", 0);
+        int core = ReadInt(topo + "core_id", cpu);
+        auto key = std::make_pair(package, core);
+        if (cores.find(key) == cores.end()) {
+            cores[key] = cpu;
+        }
+    }
+    //按节点分组后轮流取
+    std::map<int, std::vector<int>> byNode;
+    for (auto& kv : cores) {
+        byNode[CpuNumaNode(kv.second)].push_back(kv.second);
+    }
+    for (auto& kv : byNode) {
+        std::sort(kv.second.begin(), kv.second.end());
+    }
+    std::vector<int> cpus;
+    for (size_t k = 0; cpus.size() < cores.size(); k++) {
+        for (auto& kv : byNode) {
+            if (k < kv.second.size()) {
+                cpus.push_back(kv.second[k]);
+            }
+        }
+    }
+    return cpus;
+}
+
+bool PinCurrentThread(int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        std::cout << "invalid cpu! cpu=" << cpu << std::endl;
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        std::cout << "pthread_setaffinity_np failed! cpu=" << cpu << " ret=" << ret << std::endl;
+        return false;
+    }
+    //之后isolate堆等内存优先从本节点分配
+    int node = CpuNumaNode(cpu);
+    if (node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, kMpolPreferred, &mask, sizeof(mask) * 8) != 0) {
+            std::cout << "set_mempolicy failed! node=" << node << std::endl;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
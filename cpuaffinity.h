@@ -0,0 +1,15 @@
+/**
+ * @brief 工作线程的CPU绑定与NUMA内存策略
+*/
+#pragma once
+#include <vector>
+
+//默认的工作线程CPU列表: 每个物理核取一个逻辑CPU(不用超线程兄弟)，按NUMA节点轮流排列，
+//这样前n个线程会均匀分布到各个节点。只包含进程允许使用的CPU，读不到/sys拓扑信息时返回全部允许的逻辑CPU
+std::vector<int> DefaultWorkerCpus();
+
+//cpu所在的NUMA节点，不支持NUMA时返回-1
+int CpuNumaNode(int cpu);
+
+//把当前线程绑定到cpu，并让之后的内存分配优先使用该cpu所在节点，cpu超出范围或绑定失败返回false
+bool PinCurrentThread(int cpu);
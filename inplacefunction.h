@@ -0,0 +1,143 @@
+/**
+ * @brief 只可移动、小对象内联存储的函数包装
+*/
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename Sig, size_t Size = 48>
+class InplaceFunction;
+
+//与std::function用法一致，区别是:
+//1.只能移动，可以保存只能移动的可调用对象(如捕获了std::promise的lambda)
+//2.可调用对象不超过Size字节时直接存放在对象内部，不分配堆内存，超过时才退化为堆分配
+template<typename R, typename... Args, size_t Size>
+class InplaceFunction<R(Args...), Size>
+{
+public:
+    InplaceFunction() = default;
+    InplaceFunction(std::nullptr_t) {}
+
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type>
+    InplaceFunction(F&& f)
+    {
+        using Fn = typename std::decay<F>::type;
+        if constexpr (IsInline<Fn>()) {
+            new (&storage_) Fn(std::forward<F>(f));
+            ops_ = &InlineOps<Fn>::ops;
+        }
+        else {
+            *reinterpret_cast<Fn**>(&storage_) = new Fn(std::forward<F>(f));
+            ops_ = &HeapOps<Fn>::ops;
+        }
+    }
+
+    InplaceFunction(InplaceFunction&& other) noexcept
+    {
+        MoveFrom(other);
+    }
+
+    InplaceFunction& operator=(InplaceFunction&& other) noexcept
+    {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    InplaceFunction& operator=(std::nullptr_t)
+    {
+        Reset();
+        return *this;
+    }
+
+    InplaceFunction(const InplaceFunction&) = delete;
+    InplaceFunction& operator=(const InplaceFunction&) = delete;
+
+    ~InplaceFunction() { Reset(); }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    R operator()(Args... args) const
+    {
+        return ops_->invoke(const_cast<Storage*>(&storage_), std::forward<Args>(args)...);
+    }
+
+private:
+    using Storage = typename std::aligned_storage<Size, alignof(std::max_align_t)>::type;
+
+    struct Ops
+    {
+        R (*invoke)(Storage* s, Args&&... args);
+        void (*move)(Storage* dst, Storage* src);
+        void (*destroy)(Storage* s);
+    };
+
+    template<typename Fn>
+    static constexpr bool IsInline()
+    {
+        return sizeof(Fn) <= Size && alignof(Fn) <= alignof(Storage)
+            && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template<typename Fn>
+    struct InlineOps
+    {
+        static R Invoke(Storage* s, Args&&... args)
+        {
+            return (*reinterpret_cast<Fn*>(s))(std::forward<Args>(args)...);
+        }
+        static void Move(Storage* dst, Storage* src)
+        {
+            new (dst) Fn(std::move(*reinterpret_cast<Fn*>(src)));
+            reinterpret_cast<Fn*>(src)->~Fn();
+        }
+        static void Destroy(Storage* s)
+        {
+            reinterpret_cast<Fn*>(s)->~Fn();
+        }
+        static constexpr Ops ops = { &Invoke, &Move, &Destroy };
+    };
+
+    template<typename Fn>
+    struct HeapOps
+    {
+        static R Invoke(Storage* s, Args&&... args)
+        {
+            return (**reinterpret_cast<Fn**>(s))(std::forward<Args>(args)...);
+        }
+        static void Move(Storage* dst, Storage* src)
+        {
+            *reinterpret_cast<Fn**>(dst) = *reinterpret_cast<Fn**>(src);
+        }
+        static void Destroy(Storage* s)
+        {
+            delete *reinterpret_cast<Fn**>(s);
+        }
+        static constexpr Ops ops = { &Invoke, &Move, &Destroy };
+    };
+
+    void MoveFrom(InplaceFunction& other)
+    {
+        if (other.ops_ != nullptr) {
+            other.ops_->move(&storage_, &other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    void Reset()
+    {
+        if (ops_ != nullptr) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    Storage storage_;
+    const Ops* ops_ = nullptr;
+};
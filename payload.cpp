@@ -0,0 +1,73 @@
+#include "payload.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+PayloadPool& PayloadPool::Instance()
+{
+    //不析构，避免进程退出时还有数据块未归还
+    static PayloadPool* pool = new PayloadPool();
+    return *pool;
+}
+
+PayloadPool::PayloadPool()
+{
+    for (int c = kMinClass; c <= kMaxClass; c++) {
+        size_t num = std::min(kClassBytes >> c, kClassMaxNum);
+        //队列容量至少为2，不足2块的级别不缓存，否则会超出字节上限
+        if (num >= 2) {
+            freelists_[c - kMinClass].reset(new TaskRing<PayloadBuffer*>(num));
+        }
+    }
+}
+
+PayloadBuffer* PayloadPool::Acquire(size_t size)
+{
+    int c = kMinClass;
+    while (c <= kMaxClass && ((size_t)1 << c) < size + 1) {
+        c++;
+    }
+    PayloadBuffer* buf = nullptr;
+    if (c <= kMaxClass && freelists_[c - kMinClass] && freelists_[c - kMinClass]->TryPop(buf)) {
+        buf->refs.store(1, std::memory_order_relaxed);
+        buf->size = size;
+        return buf;
+    }
+    size_t capacity = c <= kMaxClass ? ((size_t)1 << c) : size + 1;
+    void* mem = std::malloc(sizeof(PayloadBuffer) + capacity);
+    if (mem == nullptr) {
+        throw std::bad_alloc();
+    }
+    buf = new (mem) PayloadBuffer();
+    buf->refs.store(1, std::memory_order_relaxed);
+    buf->size = size;
+    buf->capacity = capacity;
+    buf->sizeClass = c;
+    return buf;
+}
+
+void PayloadPool::Release(PayloadBuffer* buf)
+{
+    if (buf->sizeClass <= kMaxClass && freelists_[buf->sizeClass - kMinClass]
+        && freelists_[buf->sizeClass - kMinClass]->TryPush(std::move(buf))) {
+        return;
+    }
+    buf->~PayloadBuffer();
+    std::free(buf);
+}
+
+Payload::Payload(const char* data, size_t size)
+{
+    buf_ = PayloadPool::Instance().Acquire(size);
+    std::memcpy(buf_->data(), data, size);
+    buf_->data()[size] = '\0';
+}
+
+void Payload::Reset()
+{
+    if (buf_ != nullptr && buf_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        PayloadPool::Instance().Release(buf_);
+    }
+    buf_ = nullptr;
+}
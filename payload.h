@@ -0,0 +1,86 @@
+/**
+ * @brief 引用计数的池化任务数据
+*/
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "taskqueue.h"
+
+//数据块，头部与数据在同一次分配中，数据后面总是多留一个'\0'
+struct PayloadBuffer
+{
+    std::atomic<int> refs;
+    size_t size;
+    size_t capacity;
+    int sizeClass;
+
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+//按容量分级缓存空闲数据块，稳态下获取/释放都不需要malloc
+class PayloadPool
+{
+public:
+    static PayloadPool& Instance();
+
+    //获取一个至少能放下size字节的数据块，引用计数为1
+    PayloadBuffer* Acquire(size_t size);
+
+    //引用计数归零时调用，放回空闲链表，链表满了才真正释放
+    void Release(PayloadBuffer* buf);
+
+private:
+    PayloadPool();
+
+    //最小256字节，最大16M，超过的不按级分配
+    static constexpr int kMinClass = 8;
+    static constexpr int kMaxClass = 24;
+    //每一级最多缓存的字节数，且每级最多4096块；放不下2块的级别(8M、16M)不缓存。
+    //各级合计最多缓存1M+2M+4M+8M*12(2K~4M)=103M
+    static constexpr size_t kClassBytes = 8 * 1024 * 1024;
+    static constexpr size_t kClassMaxNum = 4096;
+
+    std::unique_ptr<TaskRing<PayloadBuffer*>> freelists_[kMaxClass - kMinClass + 1];
+};
+
+//任务数据句柄: 拷贝只增加引用计数，同一份数据可以被多个任务共享而不复制
+class Payload
+{
+public:
+    Payload() = default;
+    Payload(const char* data, size_t size);
+    Payload(const std::string& str) : Payload(str.data(), str.size()) {}
+    Payload(const char* str) : Payload(str, std::strlen(str)) {}
+
+    Payload(const Payload& other) : buf_(other.buf_)
+    {
+        if (buf_ != nullptr) {
+            buf_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Payload(Payload&& other) noexcept : buf_(other.buf_) { other.buf_ = nullptr; }
+
+    Payload& operator=(Payload other) noexcept
+    {
+        std::swap(buf_, other.buf_);
+        return *this;
+    }
+
+    ~Payload() { Reset(); }
+
+    const char* data() const { return buf_ != nullptr ? buf_->data() : ""; }
+    size_t size() const { return buf_ != nullptr ? buf_->size : 0; }
+    bool empty() const { return size() == 0; }
+    //是否只有这一个句柄引用数据，此时修改数据不会影响其他任务
+    bool unique() const { return buf_ == nullptr || buf_->refs.load(std::memory_order_acquire) == 1; }
+    std::string str() const { return std::string(data(), size()); }
+
+    void Reset();
+
+private:
+    PayloadBuffer* buf_ = nullptr;
+};
@@ -0,0 +1,334 @@
+/**
+ * @brief 按v8 ValueSerializer格式构造任务数据，解析结构化结果
+*/
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "payload.h"
+
+//在c++侧直接写出v8::ValueDeserializer能读取的数据，配合kTaskSerialized使用，js收到的就是对象本身，
+//不需要JSON.stringify/JSON.parse。只支持常用类型: null、undefined、布尔、整数、浮点、utf8字符串、普通对象、数组
+//用法:
+//  SerialWriter w;
+//  w.BeginObject().Key("uid").Int(1001).Key("name").String("ccy").EndObject(2);
+//  TaskType tu(w.Release(), index, callback, kTaskSerialized);
+class SerialWriter
+{
+public:
+    SerialWriter()
+    {
+        buf_.push_back((char)kTagVersion);
+        WriteVarint(kVersion);
+    }
+
+    SerialWriter& Null() { return Tag('0'); }
+    SerialWriter& Undefined() { return Tag('_'); }
+    SerialWriter& Bool(bool v) { return Tag(v ? 'T' : 'F'); }
+
+    SerialWriter& Int(int32_t v)
+    {
+        //zigzag编码
+        Tag('I');
+        WriteVarint(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+        return *this;
+    }
+
+    SerialWriter& Double(double v)
+    {
+        Tag('N');
+        buf_.append(reinterpret_cast<const char*>(&v), sizeof(v));
+        return *this;
+    }
+
+    SerialWriter& String(const char* str, size_t len)
+    {
+        Tag('S');
+        WriteVarint((uint32_t)len);
+        buf_.append(str, len);
+        return *this;
+    }
+    SerialWriter& String(const std::string& str) { return String(str.data(), str.size()); }
+    SerialWriter& String(const char* str) { return String(str, std::strlen(str)); }
+
+    //对象: BeginObject后依次写Key和值，EndObject传入属性个数
+    SerialWriter& BeginObject() { return Tag('o'); }
+    SerialWriter& Key(const std::string& key) { return String(key); }
+    SerialWriter& Key(const char* key) { return String(key); }
+    SerialWriter& EndObject(uint32_t num)
+    {
+        Tag('{');
+        WriteVarint(num);
+        return *this;
+    }
+
+    //数组: BeginArray传入长度，之后依次写length个元素
+    SerialWriter& BeginArray(uint32_t length)
+    {
+        Tag('A');
+        WriteVarint(length);
+        return *this;
+    }
+    SerialWriter& EndArray(uint32_t length)
+    {
+        Tag('$');
+        WriteVarint(0);
+        WriteVarint(length);
+        return *this;
+    }
+
+    //取出数据，之后不能再写入
+    Payload Release() { return Payload(buf_); }
+
+private:
+    static constexpr uint8_t kTagVersion = 0xFF;
+    //读取端兼容旧版本，写出的标记在13版以后没有变化
+    static constexpr uint32_t kVersion = 13;
+
+    SerialWriter& Tag(char tag)
+    {
+        buf_.push_back(tag);
+        return *this;
+    }
+
+    void WriteVarint(uint32_t v)
+    {
+        do {
+            uint8_t b = v & 0x7F;
+            v >>= 7;
+            if (v != 0) {
+                b |= 0x80;
+            }
+            buf_.push_back((char)b);
+        } while (v != 0);
+    }
+
+    std::string buf_;
+};
+
+//SerialReader的读取结果类型
+enum class SerialType
+{
+    kEnd,           //数据读完
+    kNull,
+    kUndefined,
+    kBool,
+    kInt,
+    kDouble,
+    kString,
+    kBeginObject,   //之后依次是键和值，直到kEndObject
+    kEndObject,     //Count()为属性个数
+    kBeginArray,    //Count()为数组长度，之后依次是length个元素，直到kEndArray
+    kEndArray,      //Count()为数组长度
+    kError,         //数据损坏或遇到不支持的类型，Error()为原因，之后不能继续读取
+};
+
+//解析kTaskSerialized任务的结果，即js返回值经ValueSerializer写出的数据。支持的类型与SerialWriter相同，
+//字符串统一转为utf8；Map、Set、Date、稀疏数组、重复引用的对象等不支持的类型返回kError
+//用法:
+//  SerialReader r(std::get<1>(result));
+//  for (SerialType t = r.Next(); t != SerialType::kEnd && t != SerialType::kError; t = r.Next()) {
+//      if (t == SerialType::kInt) { r.IntValue(); }
+//  }
+class SerialReader
+{
+public:
+    SerialReader(const char* data, size_t size)
+        : cur_(reinterpret_cast<const uint8_t*>(data)), end_(reinterpret_cast<const uint8_t*>(data) + size)
+    {
+        uint32_t version = 0;
+        if (cur_ == end_ || *cur_++ != kTagVersion || !ReadVarint(version)) {
+            Fail("bad header");
+        }
+        else if (version < kMinVersion || version > kMaxVersion) {
+            Fail("unsupported version " + std::to_string(version));
+        }
+    }
+    explicit SerialReader(const std::string& data) : SerialReader(data.data(), data.size()) {}
+
+    //读取下一个值
+    SerialType Next()
+    {
+        if (type_ == SerialType::kError) {
+            return type_;
+        }
+        //双字节字符串前可能有对齐用的填充
+        while (cur_ != end_ && *cur_ == '\0') {
+            cur_++;
+        }
+        if (cur_ == end_) {
+            return type_ = SerialType::kEnd;
+        }
+        uint8_t tag = *cur_++;
+        switch (tag) {
+        case '0':
+            return type_ = SerialType::kNull;
+        case '_':
+        case '-':   //稠密数组中的空位按undefined处理
+            return type_ = SerialType::kUndefined;
+        case 'T':
+        case 'F':
+            bool_ = tag == 'T';
+            return type_ = SerialType::kBool;
+        case 'I': {
+            uint32_t v = 0;
+            if (!ReadVarint(v)) {
+                return Fail("bad int");
+            }
+            //zigzag解码
+            int_ = (int32_t)((v >> 1) ^ (~(v & 1) + 1));
+            return type_ = SerialType::kInt;
+        }
+        case 'U': {
+            uint32_t v = 0;
+            if (!ReadVarint(v)) {
+                return Fail("bad uint");
+            }
+            double_ = v;
+            return type_ = SerialType::kDouble;
+        }
+        case 'N':
+            if ((size_t)(end_ - cur_) < sizeof(double_)) {
+                return Fail("bad double");
+            }
+            std::memcpy(&double_, cur_, sizeof(double_));
+            cur_ += sizeof(double_);
+            return type_ = SerialType::kDouble;
+        case 'S':
+        case '"':
+        case 'c':
+            return ReadString(tag);
+        case 'o':
+            return type_ = SerialType::kBeginObject;
+        case '{':
+            return ReadCount(SerialType::kEndObject);
+        case 'A':
+            return ReadCount(SerialType::kBeginArray);
+        case '$': {
+            //结束标记后是属性个数(稠密数组恒为0)和数组长度
+            uint32_t props = 0;
+            if (!ReadVarint(props)) {
+                return Fail("bad array end");
+            }
+            return ReadCount(SerialType::kEndArray);
+        }
+        default:
+            return Fail(std::string("unsupported tag '") + (char)tag + "'");
+        }
+    }
+
+    SerialType Type() const { return type_; }
+    bool BoolValue() const { return bool_; }
+    int32_t IntValue() const { return int_; }
+    double DoubleValue() const { return double_; }
+    const std::string& StringValue() const { return str_; }
+    uint32_t Count() const { return count_; }
+    const std::string& Error() const { return error_; }
+
+private:
+    static constexpr uint8_t kTagVersion = 0xFF;
+    //13版以后本类支持的标记没有变化
+    static constexpr uint32_t kMinVersion = 13;
+    static constexpr uint32_t kMaxVersion = 15;
+
+    SerialType Fail(const std::string& error)
+    {
+        error_ = error;
+        return type_ = SerialType::kError;
+    }
+
+    bool ReadVarint(uint32_t& v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 35 && cur_ != end_; shift += 7) {
+            uint8_t b = *cur_++;
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if ((b & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    SerialType ReadCount(SerialType type)
+    {
+        if (!ReadVarint(count_)) {
+            return Fail("bad count");
+        }
+        return type_ = type;
+    }
+
+    //S为utf8，"为单字节(latin1)，c为双字节(utf16)，都转成utf8
+    SerialType ReadString(uint8_t tag)
+    {
+        uint32_t len = 0;
+        if (!ReadVarint(len) || (size_t)(end_ - cur_) < len || (tag == 'c' && len % 2 != 0)) {
+            return Fail("bad string");
+        }
+        str_.clear();
+        if (tag == 'S') {
+            str_.assign(reinterpret_cast<const char*>(cur_), len);
+        }
+        else if (tag == '"') {
+            for (uint32_t i = 0; i < len; i++) {
+                AppendUtf8(cur_[i]);
+            }
+        }
+        else {
+            for (uint32_t i = 0; i < len; i += 2) {
+                uint32_t c = ReadUnit(i);
+                if (c >= 0xD800 && c <= 0xDBFF && i + 2 < len) {
+                    uint32_t low = ReadUnit(i + 2);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                        i += 2;
+                    }
+                }
+                //落单的代理项替换为U+FFFD
+                AppendUtf8(c >= 0xD800 && c <= 0xDFFF ? 0xFFFD : c);
+            }
+        }
+        cur_ += len;
+        return type_ = SerialType::kString;
+    }
+
+    //ValueSerializer按本机字节序写出双字节字符串
+    uint32_t ReadUnit(uint32_t offset) const
+    {
+        uint16_t unit = 0;
+        std::memcpy(&unit, cur_ + offset, sizeof(unit));
+        return unit;
+    }
+
+    void AppendUtf8(uint32_t c)
+    {
+        if (c < 0x80) {
+            str_.push_back((char)c);
+        }
+        else if (c < 0x800) {
+            str_.push_back((char)(0xC0 | (c >> 6)));
+            str_.push_back((char)(0x80 | (c & 0x3F)));
+        }
+        else if (c < 0x10000) {
+            str_.push_back((char)(0xE0 | (c >> 12)));
+            str_.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            str_.push_back((char)(0x80 | (c & 0x3F)));
+        }
+        else {
+            str_.push_back((char)(0xF0 | (c >> 18)));
+            str_.push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+            str_.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            str_.push_back((char)(0x80 | (c & 0x3F)));
+        }
+    }
+
+    const uint8_t* cur_;
+    const uint8_t* end_;
+    SerialType type_ = SerialType::kEnd;
+    bool bool_ = false;
+    int32_t int_ = 0;
+    double double_ = 0;
+    uint32_t count_ = 0;
+    std::string str_;
+    std::string error_;
+};
@@ -0,0 +1,141 @@
+/**
+ * @brief 有界无锁环形队列
+*/
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+//缓存行大小，用于隔离生产者/消费者各自的游标，避免伪共享
+constexpr size_t kCacheLineSize = 64;
+
+//基于序号的有界环形队列(Vyukov算法)，支持多生产者，
+//每个槽位自带序号，入队/出队只需一次CAS，不需要任何锁
+template<typename T>
+class TaskRing
+{
+public:
+    explicit TaskRing(size_t capacity)
+    {
+        //容量向上取整为2的幂，下标用位与代替取模
+        size_t cap = 2;
+        while (cap < capacity) {
+            cap <<= 1;
+        }
+        mask_ = cap - 1;
+        cells_.reset(new Cell[cap]);
+        for (size_t i = 0; i < cap; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+        enqueuePos_.store(0, std::memory_order_relaxed);
+        dequeuePos_.store(0, std::memory_order_relaxed);
+    }
+
+    TaskRing(const TaskRing&) = delete;
+    TaskRing& operator=(const TaskRing&) = delete;
+
+    //入队，队列满时返回false且不移动val
+    bool TryPush(T&& val)
+    {
+        Cell* cell;
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (dif < 0) {
+                return false;
+            }
+            else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(val);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    //批量入队，一次CAS预留连续槽位，返回实际入队个数(队列剩余空间不足时只入队一部分)
+    size_t TryPushBulk(T* vals, size_t n)
+    {
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        size_t count;
+        while (true) {
+            size_t head = dequeuePos_.load(std::memory_order_acquire);
+            size_t used = pos > head ? pos - head : 0;
+            size_t space = used < Capacity() ? Capacity() - used : 0;
+            count = n < space ? n : space;
+            if (count == 0) {
+                return 0;
+            }
+            if (enqueuePos_.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            Cell* cell = &cells_[(pos + i) & mask_];
+            //槽位已被消费者领取，等待其搬走数据后再写入
+            while (cell->seq.load(std::memory_order_acquire) != pos + i) {
+            }
+            cell->data = std::move(vals[i]);
+            cell->seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    //出队，队列空时返回false
+    bool TryPop(T& out)
+    {
+        Cell* cell;
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (dif < 0) {
+                return false;
+            }
+            else {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        out = std::move(cell->data);
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    //当前元素个数(近似值，并发时仅供参考)
+    size_t Size() const
+    {
+        size_t tail = enqueuePos_.load(std::memory_order_acquire);
+        size_t head = dequeuePos_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+    size_t Capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(kCacheLineSize) std::atomic<size_t> enqueuePos_;
+    alignas(kCacheLineSize) std::atomic<size_t> dequeuePos_;
+};
@@ -13,6 +13,7 @@
 #include "v8.h"
 
 #include "v8engine.h"
+#include "v8call.h"
 #include "base64.h"
 
 using namespace v8;
@@ -581,51 +582,22 @@ void jstest_battle()
   delete create_params.array_buffer_allocator;
 }
 
-void AddStringToArguments(v8::Isolate* isolate, std::string str, v8::Handle<v8::Value> argList[], unsigned int argPos)
-{
-  argList[argPos] = v8::String::NewFromUtf8(isolate, str.c_str()).ToLocalChecked();
-}
-
-void AddNumberToArguments(v8::Isolate* isolate, double num, v8::Handle<v8::Value> argList[], unsigned int argPos)
-{
-    argList[argPos] = v8::Number::New(isolate, num);
-}
-
-void AddBooleanToArguments(v8::Isolate* isolate, bool value, v8::Handle<v8::Value> argList[], unsigned int argPos)
-{
-    argList[argPos] = v8::Boolean::New(isolate, value);
-}
-
 /**
-* CallJSFunction(Handle<v8::Object>, string, Handle<Value>, UINT)
+* CallJSFunction(Handle<v8::Context>, Handle<v8::Object>, string, Args...)
 * / Handle of the global that is running the script with desired function
 * / Title of the JS fuction
-* / List of arguments for function
-* / Number of agrguments
-* Returns the return value of the JS function
+* / Arguments of the function, converted by V8Convert at compile time
+* Returns the return value of the JS function converted to Ret
 **/
-v8::Handle<v8::Value> CallJSFunction(v8::Handle<v8::Context> context,
-   v8::Handle<v8::Object> global, std::string funcName, v8::Handle<v8::Value> argList[], unsigned int argCount)
+template<typename Ret, typename... Args>
+v8::Maybe<Ret> CallJSFunction(v8::Local<v8::Context> context, v8::Local<v8::Object> global, const std::string& funcName, Args&&... args)
 {
-  // Create value for the return of the JS function
-  v8::Handle<v8::Value> jsResult;
-  // Grab JS function out of file
-  // v8::Handle<v8::Value> funcKey = v8::String::NewFromUtf8(context->GetIsolate(), funcName.c_str()).ToLocalChecked();
-  // v8::Handle<v8::Value> value = global->Get(context, funcKey).ToLocalChecked();
-
   auto isolate = context->GetIsolate();
-  v8::Local<v8::Function> myFunction = v8::Local<v8::Function>::Cast(global->Get(context, v8::String::NewFromUtf8(isolate, "myFunction").ToLocalChecked()).ToLocalChecked());
-  v8::Local<v8::Value> args[2] = {v8::Number::New(context->GetIsolate(), 2), v8::Number::New(context->GetIsolate(), 3)};
-  //v8::Local<v8::Value> result = myFunction->Call(context, v8::Null(isolate), 2, args).ToLocalChecked();
-  v8::Local<v8::Value> result = myFunction->Call(context, context->Global(), 2, args).ToLocalChecked();
-
-  // Cast value to v8::Function
-  // v8::Local<v8::Function> func = v8::Local<v8::Function>::Cast(value);
-  // Call function with all set values
-  // v8::Local<v8::Value> args[2] = {v8::Number::New(context->GetIsolate(), 2), v8::Number::New(context->GetIsolate(), 3)};
-  // v8::MaybeLocal<v8::Value> result = func->Call(context, v8::Null(context->GetIsolate()), 0, nullptr);
-  // Return value from function
-  return jsResult;
+  v8::Local<v8::Value> value;
+  if (!global->Get(context, v8::String::NewFromUtf8(isolate, funcName.c_str()).ToLocalChecked()).ToLocal(&value) || !value->IsFunction()) {
+    return v8::Nothing<Ret>();
+  }
+  return V8Call<Ret>(context, value.As<v8::Function>(), global, std::forward<Args>(args)...);
 }
 
 void ExecuteScript(v8::Isolate* isolate, const char* script) {
@@ -727,8 +699,6 @@ void V8Initialize()
   v8::V8::Initialize();
 }
 
-using ResultType = std::tuple<std::function<void(std::string)>, std::string>;
-
 int main(int argc, char* argv[])
 {
   //1、测试
@@ -757,22 +727,42 @@ int main(int argc, char* argv[])
 
   int threadNum = 8;
   v8engine v8obj;
-  v8obj.Create(threadNum, base64str, false);
+  if (!v8obj.Create(threadNum, base64str, false)) {
+    std::cout << "v8engine create failed!" << std::endl;
+    return 1;
+  }
   std::this_thread::sleep_for(std::chrono::seconds(2));
   for(int i = 0; i < 3; i++){
     std::cout << " " << std::endl;
   }
 
   while (1) {
-    std::cout << "输入命令:1-继续执行 2-关闭v8engine 3-输出堆栈 4-执行gc" << std::endl;
+    std::cout << "输入命令:1-继续执行 2-关闭v8engine 3-输出堆栈 4-执行gc 6-以二进制数据执行" << std::endl;
     int a;
     std::cin >> a;
     if(a == 1) {
       int tasknum = 50000;
       v8obj.StartStat(tasknum);
+      //同一份数据只拷贝一次，所有任务共享引用
+      Payload payload(base64str);
+      std::vector<TaskType> tasks;
+      tasks.reserve(tasknum);
+      for(int i = 1; i <= tasknum; i++) {
+          tasks.push_back({payload, (uint32_t)i, [](std::string){}, kTaskOneByte});
+      }
+      v8obj.PushTasks(tasks);
+    }
+    else if (a == 6) {
+      //原始字节直接交给js，不做base64编码
+      int tasknum = 50000;
+      v8obj.StartStat(tasknum);
+      Payload payload(bt);
+      std::vector<TaskType> tasks;
+      tasks.reserve(tasknum);
       for(int i = 1; i <= tasknum; i++) {
-          v8obj.PushTask({base64str, i, [](std::string){}});
+          tasks.push_back({payload, (uint32_t)i, [](std::string){}, kTaskBinary});
       }
+      v8obj.PushTasks(tasks);
     }
     else if (a == 2) {
       v8obj.Release();
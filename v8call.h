@@ -0,0 +1,212 @@
+/**
+ * @brief 编译期确定参数类型的js函数调用
+*/
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "v8.h"
+#include "payload.h"
+
+//c++类型与js值的转换，ToV8把参数转为js值，FromV8把返回值转回c++类型，类型不符返回false
+template<typename T, typename = void>
+struct V8Convert;
+
+template<>
+struct V8Convert<bool>
+{
+    static v8::Local<v8::Value> ToV8(v8::Isolate* isolate, bool v) { return v8::Boolean::New(isolate, v); }
+    static bool FromV8(v8::Isolate* /*isolate*/, v8::Local<v8::Context> /*context*/, v8::Local<v8::Value> v, bool& out)
+    {
+        if (!v->IsBoolean()) {
+            return false;
+        }
+        out = v.As<v8::Boolean>()->Value();
+        return true;
+    }
+};
+
+//32位以内的整数用Integer，更大的整数和浮点数用Number
+template<typename T>
+struct V8Convert<T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    static v8::Local<v8::Value> ToV8(v8::Isolate* isolate, T v)
+    {
+        if constexpr (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) <= 4) {
+            return v8::Integer::New(isolate, (int32_t)v);
+        }
+        else if constexpr (std::is_integral<T>::value && std::is_unsigned<T>::value && sizeof(T) <= 4) {
+            return v8::Integer::NewFromUnsigned(isolate, (uint32_t)v);
+        }
+        else {
+            return v8::Number::New(isolate, (double)v);
+        }
+    }
+    static bool FromV8(v8::Isolate* /*isolate*/, v8::Local<v8::Context> /*context*/, v8::Local<v8::Value> v, T& out)
+    {
+        if (!v->IsNumber()) {
+            return false;
+        }
+        double d = v.As<v8::Number>()->Value();
+        if constexpr (std::is_integral<T>::value) {
+            //必须是T能表示的整数，NaN、无穷大、小数和超出范围的值直接转换是未定义行为；
+            //上界取2的位数次方，避免最大值转double时进位造成误判
+            constexpr double kUpper = std::is_signed<T>::value ? -(double)std::numeric_limits<T>::min()
+                : 2.0 * ((double)(std::numeric_limits<T>::max() / 2) + 1);
+            if (!(d >= (double)std::numeric_limits<T>::min() && d < kUpper) || d != std::trunc(d)) {
+                return false;
+            }
+        }
+        else if (std::isfinite(d) && std::fabs(d) > (double)std::numeric_limits<T>::max()) {
+            //超出float范围的有限值同样不能直接转换
+            return false;
+        }
+        out = (T)d;
+        return true;
+    }
+};
+
+template<>
+struct V8Convert<std::string>
+{
+    static v8::Local<v8::Value> ToV8(v8::Isolate* isolate, const std::string& v)
+    {
+        return v8::String::NewFromUtf8(isolate, v.data(), v8::NewStringType::kNormal, (int)v.size()).ToLocalChecked();
+    }
+    static bool FromV8(v8::Isolate* isolate, v8::Local<v8::Context> /*context*/, v8::Local<v8::Value> v, std::string& out)
+    {
+        if (!v->IsString()) {
+            return false;
+        }
+        v8::Local<v8::String> str = v.As<v8::String>();
+        int len = str->Utf8Length(isolate);
+        out.resize(len);
+        str->WriteUtf8(isolate, &out[0], len, nullptr, v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+        return true;
+    }
+};
+
+template<>
+struct V8Convert<const char*>
+{
+    static v8::Local<v8::Value> ToV8(v8::Isolate* isolate, const char* v)
+    {
+        return v8::String::NewFromUtf8(isolate, v).ToLocalChecked();
+    }
+};
+
+template<>
+struct V8Convert<char*> : V8Convert<const char*> {};
+
+template<>
+struct V8Convert<Payload>
+{
+    static v8::Local<v8::Value> ToV8(v8::Isolate* isolate, const Payload& v)
+    {
+        return v8::String::NewFromUtf8(isolate, v.data(), v8::NewStringType::kNormal, (int)v.size()).ToLocalChecked();
+    }
+};
+
+//js值原样传递/返回，返回值按T检查类型，不符时返回false；未列出的T不能作为返回值
+template<typename T>
+struct V8Convert<v8::Local<T>>
+{
+    static v8::Local<v8::Value> ToV8(v8::Isolate* /*isolate*/, v8::Local<T> v) { return v; }
+    static bool FromV8(v8::Isolate* /*isolate*/, v8::Local<v8::Context> /*context*/, v8::Local<v8::Value> v, v8::Local<T>& out)
+    {
+        if (!Is(v)) {
+            return false;
+        }
+        out = v.template As<T>();
+        return true;
+    }
+
+private:
+    static bool Is(v8::Local<v8::Value> v)
+    {
+        if constexpr (std::is_same<T, v8::Value>::value) {
+            return true;
+        }
+        else if constexpr (std::is_same<T, v8::Primitive>::value) {
+            return !v->IsObject();
+        }
+        else if constexpr (std::is_same<T, v8::Boolean>::value) {
+            return v->IsBoolean();
+        }
+        else if constexpr (std::is_same<T, v8::Number>::value) {
+            return v->IsNumber();
+        }
+        else if constexpr (std::is_same<T, v8::Integer>::value) {
+            return v->IsInt32() || v->IsUint32();
+        }
+        else if constexpr (std::is_same<T, v8::Int32>::value) {
+            return v->IsInt32();
+        }
+        else if constexpr (std::is_same<T, v8::Uint32>::value) {
+            return v->IsUint32();
+        }
+        else if constexpr (std::is_same<T, v8::BigInt>::value) {
+            return v->IsBigInt();
+        }
+        else if constexpr (std::is_same<T, v8::String>::value) {
+            return v->IsString();
+        }
+        else if constexpr (std::is_same<T, v8::Object>::value) {
+            return v->IsObject();
+        }
+        else if constexpr (std::is_same<T, v8::Array>::value) {
+            return v->IsArray();
+        }
+        else if constexpr (std::is_same<T, v8::Function>::value) {
+            return v->IsFunction();
+        }
+        else if constexpr (std::is_same<T, v8::Promise>::value) {
+            return v->IsPromise();
+        }
+        else if constexpr (std::is_same<T, v8::ArrayBuffer>::value) {
+            return v->IsArrayBuffer();
+        }
+        else if constexpr (std::is_same<T, v8::ArrayBufferView>::value) {
+            return v->IsArrayBufferView();
+        }
+        else if constexpr (std::is_same<T, v8::Uint8Array>::value) {
+            return v->IsUint8Array();
+        }
+        else {
+            static_assert(sizeof(T) == 0, "unsupported return handle type");
+            return false;
+        }
+    }
+};
+
+//调用js函数: 参数数组在栈上按编译期类型逐个转换，返回值直接转为Ret
+//js抛出异常、被终止，或返回值类型不符、超出Ret的范围时返回Nothing，异常由调用者的TryCatch捕获
+//用法: double sum; if (V8Call<double>(context, func, context->Global(), 2, 3).To(&sum)) {...}
+//      V8Call<void>(context, func, recv, "tick").IsJust()
+template<typename Ret, typename... Args>
+v8::Maybe<Ret> V8Call(v8::Local<v8::Context> context, v8::Local<v8::Function> func, v8::Local<v8::Value> recv, Args&&... args)
+{
+    v8::Isolate* isolate = context->GetIsolate();
+    //多留一个位置，避免没有参数时出现0长度数组
+    v8::Local<v8::Value> argv[sizeof...(Args) + 1] = {
+        V8Convert<typename std::decay<Args>::type>::ToV8(isolate, std::forward<Args>(args))...
+    };
+    v8::Local<v8::Value> result;
+    if (!func->Call(context, recv, (int)sizeof...(Args), argv).ToLocal(&result)) {
+        return v8::Nothing<Ret>();
+    }
+    if constexpr (std::is_void<Ret>::value) {
+        //不关心返回值，调用成功即可
+        return v8::JustVoid();
+    }
+    else {
+        Ret ret;
+        if (!V8Convert<Ret>::FromV8(isolate, context, result, ret)) {
+            return v8::Nothing<Ret>();
+        }
+        return v8::Just<Ret>(std::move(ret));
+    }
+}
@@ -1,12 +1,24 @@
 #include "v8engine.h"
 #include "libplatform/libplatform.h"
 #include "v8.h"
+#include "v8-value-serializer.h"
+#include "v8call.h"
+#include "cpuaffinity.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 using namespace std;
 using namespace v8;
 
 std::unique_ptr<v8::Platform> v8platform; //必须是全局的变量
 const string target_func_name = "onReceiveBattleRsp";
+const string target_batch_func_name = "onReceiveBattleRspBatch";
 
 void V8ConsoleMessageCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
@@ -55,10 +67,236 @@ void V8PrintHeapStats(v8::Isolate* isolate, int index) {
     std::cout << "Used heap size: " << heap_stats.used_heap_size() / 1024 << " KB" << std::endl;
 }
 
-void v8engine::V8ExecuteScript(v8::Isolate* isolate, const char* jscode, int index) {
-    v8::Locker locker(isolate);
-    v8::Isolate::Scope isolate_scope(isolate);
+//外部单字节字符串: 持有任务数据的引用，v8直接引用这块内存，js字符串被回收时释放引用
+class PayloadStringResource : public v8::String::ExternalOneByteStringResource
+{
+public:
+    explicit PayloadStringResource(const Payload& payload) : payload_(payload) {}
+    const char* data() const override { return payload_.data(); }
+    size_t length() const override { return payload_.size(); }
+
+private:
+    Payload payload_;
+};
+
+//小于这个长度的数据直接复制，外部字符串本身的开销不划算
+const size_t kExternalStringMinSize = 1024;
+
+//任务数据转为js字符串，标记了kTaskOneByte的大数据不复制
+v8::Local<v8::String> V8PayloadString(v8::Isolate* isolate, const TaskType& tu)
+{
+    const Payload& data = tu.data;
+    if ((tu.flags & kTaskOneByte) && data.size() >= kExternalStringMinSize) {
+        PayloadStringResource* resource = new PayloadStringResource(data);
+        v8::Local<v8::String> str;
+        if (v8::String::NewExternalOneByte(isolate, resource).ToLocal(&str)) {
+            return str;
+        }
+        //超过字符串最大长度等情况，v8没有接管resource
+        delete resource;
+    }
+    return v8::String::NewFromUtf8(isolate, data.data(), v8::NewStringType::kNormal, data.size()).ToLocalChecked();
+}
+
+//任务数据转为Uint8Array，js可以修改，但修改不会影响共享同一份数据的其他任务
+v8::Local<v8::Uint8Array> V8PayloadBytes(v8::Isolate* isolate, const TaskType& tu)
+{
+    const Payload& data = tu.data;
+    std::unique_ptr<v8::BackingStore> store;
+#ifndef V8_ENABLE_SANDBOX
+    if (data.unique()) {
+        //只有本任务引用这份数据，BackingStore持有引用，不复制，ArrayBuffer被回收时释放引用
+        Payload* ref = new Payload(data);
+        store = v8::ArrayBuffer::NewBackingStore(
+            const_cast<char*>(ref->data()), ref->size(),
+            [](void*, size_t, void* deleter_data) { delete static_cast<Payload*>(deleter_data); }, ref);
+    }
+#endif
+    if (!store) {
+        //开启沙箱时ArrayBuffer的内存必须在沙箱内；数据被多个任务共享时js的修改会互相影响。
+        //这两种情况复制一次(仍省去了base64编解码)
+        store = v8::ArrayBuffer::NewBackingStore(isolate, data.size());
+        std::memcpy(store->Data(), data.data(), data.size());
+    }
+    v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(isolate, std::move(store));
+    return v8::Uint8Array::New(buffer, 0, data.size());
+}
+
+//按任务标记把数据转为js参数: kTaskSerialized为反序列化出的值，kTaskBinary为Uint8Array，否则为字符串
+bool V8PayloadValue(v8::Isolate* isolate, v8::Local<v8::Context> context, const TaskType& tu, v8::Local<v8::Value>& value)
+{
+    if (tu.flags & kTaskSerialized) {
+        v8::ValueDeserializer deserializer(isolate, reinterpret_cast<const uint8_t*>(tu.data.data()), tu.data.size());
+        bool header = false;
+        if (!deserializer.ReadHeader(context).To(&header) || !header || !deserializer.ReadValue(context).ToLocal(&value)) {
+            std::cout << "deserialize task data failed! index=" << tu.index << std::endl;
+            return false;
+        }
+        return true;
+    }
+    if (tu.flags & kTaskBinary) {
+        value = V8PayloadBytes(isolate, tu);
+        return true;
+    }
+    value = V8PayloadString(isolate, tu);
+    return true;
+}
+
+//js返回值写入结果: kTaskSerialized的任务写出序列化数据；字符串按utf8长度一次分配后直接写入，不经过Utf8Value的中间缓冲；
+//Uint8Array等二进制视图直接复制字节，不做utf8转换，js可以继续复用这块内存
+bool V8ResultString(v8::Isolate* isolate, v8::Local<v8::Value> value, uint32_t flags, std::string& out)
+{
+    if (flags & kTaskSerialized) {
+        //结构化结果按ValueSerializer格式写出
+        v8::ValueSerializer serializer(isolate);
+        serializer.WriteHeader();
+        bool ok = false;
+        if (!serializer.WriteValue(isolate->GetCurrentContext(), value).To(&ok) || !ok) {
+            return false;
+        }
+        std::pair<uint8_t*, size_t> data = serializer.Release();
+        out.assign(reinterpret_cast<const char*>(data.first), data.second);
+        std::free(data.first);
+        return true;
+    }
+    if (value->IsArrayBufferView()) {
+        v8::Local<v8::ArrayBufferView> view = value.As<v8::ArrayBufferView>();
+        out.resize(view->ByteLength());
+        view->CopyContents(&out[0], out.size());
+        return true;
+    }
+    v8::Local<v8::String> str;
+    if (value->IsString()) {
+        str = value.As<v8::String>();
+    }
+    else if (!value->ToString(isolate->GetCurrentContext()).ToLocal(&str)) {
+        return false;
+    }
+    int len = str->Utf8Length(isolate);
+    out.resize(len);
+    str->WriteUtf8(isolate, &out[0], len, nullptr, v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+    return true;
+}
+
+//批量调用js: 参数为任务数据组成的数组，返回值须为等长数组，按下标对应每个任务的结果
+bool V8CallBatch(v8::Isolate* isolate, v8::Local<v8::Context> context, v8::Local<v8::Value> recv, v8::Local<v8::Object> func,
+    std::vector<TaskType>& batch, std::vector<std::string>& results)
+{
     v8::HandleScope handle_scope(isolate);
+    v8::TryCatch trycatch(isolate);
+    v8::Local<v8::Array> arr = v8::Array::New(isolate, batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        v8::Local<v8::Value> value;
+        if (!V8PayloadValue(isolate, context, batch[i], value)) {
+            return false;
+        }
+        bool set = false;
+        if (!arr->Set(context, i, value).To(&set) || !set) {
+            return false;
+        }
+    }
+    v8::Local<v8::Value> args[1] = { arr };
+    v8::Local<v8::Value> ret;
+    if (!func->CallAsFunction(context, recv, 1, args).ToLocal(&ret)) {
+        if (trycatch.HasTerminated()) {
+            return false;
+        }
+        v8::String::Utf8Value utf8Value(isolate, trycatch.Message()->Get());
+        std::cout << "call batch function didn't return a value. exception: " << *utf8Value << std::endl;
+        return false;
+    }
+    if (!ret->IsArray() || ret.As<v8::Array>()->Length() != batch.size()) {
+        std::cout << "batch function should return an array of " << batch.size() << " results" << std::endl;
+        return false;
+    }
+    v8::Local<v8::Array> retArr = ret.As<v8::Array>();
+    results.resize(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        v8::Local<v8::Value> item;
+        if (!retArr->Get(context, i).ToLocal(&item)) {
+            return false;
+        }
+        if (!V8ResultString(isolate, item, batch[i].flags, results[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//虚拟机的脚本环境，多路复用模式下不同线程轮流进入同一个虚拟机，上下文和入口函数用Global保存
+struct ScriptEnv
+{
+    v8::ArrayBuffer::Allocator* allocator = nullptr;
+    v8::Global<v8::Context> context;
+    v8::Global<v8::Object> recv;
+    v8::Global<v8::Function> func;
+    v8::Global<v8::Object> batchFunc;
+    std::vector<TaskType> batch;
+    std::vector<std::string> batchResults;
+};
+
+//进入虚拟机后由ScriptEnv取出的Local句柄，每次进入取一次，执行任务时不再重复创建
+struct ScriptLocals
+{
+    v8::Local<v8::Context> context;
+    v8::Local<v8::Object> recv;
+    v8::Local<v8::Function> func;
+    v8::Local<v8::Object> batchFunc;
+};
+
+static ScriptLocals LocalsOf(v8::Isolate* isolate, ScriptEnv* env)
+{
+    ScriptLocals locals;
+    locals.context = env->context.Get(isolate);
+    locals.recv = env->recv.Get(isolate);
+    locals.func = env->func.Get(isolate);
+    if (!env->batchFunc.IsEmpty()) {
+        locals.batchFunc = env->batchFunc.Get(isolate);
+    }
+    return locals;
+}
+
+v8::Isolate* v8engine::NewIsolate(WorkerSlot& slot)
+{
+    slot.env = new ScriptEnv();
+    v8::Isolate::CreateParams create_params;
+    // create_params.constraints.set_max_old_generation_size_in_bytes((256*1024*1024));
+    // create_params.constraints.set_max_young_generation_size_in_bytes((128*1024*1024));
+    create_params.array_buffer_allocator = slot.env->allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    {
+        std::lock_guard<std::mutex> guard(slot.mutex);
+        slot.isolate = isolate;
+    }
+    return isolate;
+}
+
+void v8engine::DisposeIsolate(WorkerSlot& slot)
+{
+    v8::Isolate* isolate = slot.isolate;
+    {
+        //Global须在虚拟机销毁前释放
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        slot.env->context.Reset();
+        slot.env->recv.Reset();
+        slot.env->func.Reset();
+        slot.env->batchFunc.Reset();
+    }
+    {
+        std::lock_guard<std::mutex> guard(slot.mutex);
+        slot.isolate = nullptr;
+    }
+    isolate->Dispose();
+    delete slot.env->allocator;
+    delete slot.env;
+    slot.env = nullptr;
+}
+
+bool v8engine::LoadScript(WorkerSlot& slot, const char* jscode)
+{
+    v8::Isolate* isolate = slot.isolate;
+    int index = slot.index;
     v8::Local<v8::Context> context = v8::Context::New(isolate);
     v8::Context::Scope context_scope(context);
     //V8PrintHeapStats(isolate, index);
@@ -81,136 +319,612 @@ void v8engine::V8ExecuteScript(v8::Isolate* isolate, const char* jscode, int ind
     v8::Local<v8::Script> script;
     if (!v8::Script::Compile(context, source).ToLocal(&script)) {
         V8PrintException(isolate, &trycatch);
-        return;
+        return false;
     }
     v8::Local<v8::Value> result;
     if (!script->Run(context).ToLocal(&result)) {
         V8PrintException(isolate, &trycatch);
-        return;
+        return false;
     }
     v8::Local<v8::Value> objValue2;
     auto b1 = context->Global()->Get(context, v8::String::NewFromUtf8(isolate, "goCallJs").ToLocalChecked()).ToLocal(&objValue2);
     if(objValue2.IsEmpty()) {
         std::cout << ("objValue2 empty!") << std::endl;
-        return;
+        return false;
     }
     v8::Local<v8::Object> goObj = objValue2.As<v8::Object>();
     v8::Local<v8::Value> funcValue;
-    auto b2 = goObj->Get(context, v8::String::NewFromUtf8(isolate, "onReceiveBattleRsp").ToLocalChecked()).ToLocal(&funcValue);
+    auto b2 = goObj->Get(context, v8::String::NewFromUtf8(isolate, target_func_name.c_str()).ToLocalChecked()).ToLocal(&funcValue);
     if(funcValue.IsEmpty()) {
         std::cout << ("funcValue empty!") << std::endl;
-        return;
+        return false;
+    }
+    if (!funcValue->IsFunction()) {
+        std::cout << "not find function! index= " << index << ", " << target_func_name.c_str() << std::endl;
+        return false;
+    }
+    ScriptEnv* env = slot.env;
+    env->context.Reset(isolate, context);
+    env->recv.Reset(isolate, goObj);
+    env->func.Reset(isolate, funcValue.As<v8::Function>());
+    //开启批量模式且脚本提供了批量入口时，改用批量调用
+    if (config_.batchSize > 1) {
+        v8::Local<v8::Value> batchValue;
+        if (goObj->Get(context, v8::String::NewFromUtf8(isolate, target_batch_func_name.c_str()).ToLocalChecked()).ToLocal(&batchValue)
+            && batchValue->IsFunction()) {
+            env->batchFunc.Reset(isolate, batchValue.As<v8::Object>());
+            env->batch.reserve(config_.batchSize);
+            env->batchResults.reserve(config_.batchSize);
+        }
+        else {
+            std::cout << "not find batch function, fallback to single call! index=" << index << std::endl;
+        }
     }
+    std::cout << "run script! index=" << index << std::endl;
+    return true;
+}
 
-    if (funcValue->IsFunction()) {
-        std::cout << "run script! index=" << index << std::endl;
-        v8::Local<v8::Object> funcObj = funcValue.As<v8::Object>();
-        //执行任务
-        while (true)
-        {
-            tuple<string, uint32_t, std::function<void(string)>> tu;
-            {
-                //出作用域自动解锁无需调用unlock()
-                std::unique_lock<std::mutex> guard(m_mutex);
-                int i = index;
-                m_condi.wait(guard, [this, i]() {
-                    return (shutdown_ || !tasks_[i].empty());
-                } );
-                if (shutdown_) {
-                    std::cout << "shutdown ntf! index=" << index << std::endl;
-                    break;
-                }
-                if(tasks_[i].empty()) {
-                    continue;
-                }
-                tu.swap(tasks_[i].front());
-                tasks_[i].pop_front();
+void v8engine::ExecuteTask(WorkerSlot& slot, const ScriptLocals& locals, TaskType& tu)
+{
+    v8::Isolate* isolate = slot.isolate;
+    int index = slot.index;
+    if (tu.data.empty()) {
+        PostResult(slot, tu, std::string());
+        return;
+    }
+    if (!locals.batchFunc.IsEmpty()) {
+        //批量模式: 一次取出多个任务，只跨越一次c++/js边界
+        std::vector<TaskType>& batch = slot.env->batch;
+        std::vector<std::string>& batchResults = slot.env->batchResults;
+        batch.clear();
+        batch.push_back(std::move(tu));
+        while ((int)batch.size() < config_.batchSize && PopTask(index, tu)) {
+            if (tu.data.empty()) {
+                PostResult(slot, tu, std::string());
             }
-            const string& str = std::get<0>(tu);
-            auto& callback = std::get<2>(tu);
-            if(str.empty()) {
-                std::unique_lock<std::mutex> guard(m_mutexResult);
-                results_.push_back({std::move(callback), std::move(str)});
-                continue;
+            else {
+                batch.push_back(std::move(tu));
             }
-            if(str == "showmem") {
-                V8PrintHeapStats(isolate, index);
-                std::unique_lock<std::mutex> guard(m_mutexResult);
-                results_.push_back({std::move(callback), std::move(str)});
-                continue;
+        }
+        //整批的预算为各任务预算之和，有任务不限制则整批不限制
+        uint32_t budgetMs = 0;
+        for (auto& item : batch) {
+            uint32_t b = item.budgetMs ? item.budgetMs : config_.taskBudgetMs;
+            if (b == 0) {
+                budgetMs = 0;
+                break;
             }
-            if(str == "gc") {
-                startGC(isolate, index);
-                std::unique_lock<std::mutex> guard(m_mutexResult);
-                results_.push_back({std::move(callback), std::move(str)});
-                continue;
+            budgetMs += b;
+        }
+        BeginBudget(slot, budgetMs);
+        bool ok = V8CallBatch(isolate, locals.context, locals.recv, locals.batchFunc, batch, batchResults);
+        if (EndBudget(slot, isolate)) {
+            slot.overrunNum++;
+            for (auto& item : batch) {
+                PostResult(slot, item, std::string(), TaskStatus::kOverrun);
             }
-            //执行一次任务
-            {
-                //在这个作用域加handlescope管理v8::Local变量
-                v8::HandleScope handle_scope1(isolate);
-                v8::Local<v8::Value> args[2] = { v8::Integer::New(isolate, 0), v8::String::NewFromUtf8(isolate, str.c_str()).ToLocalChecked() };
-                v8::TryCatch trycatch(isolate);
-                v8::MaybeLocal<v8::Value> fresult = funcObj->CallAsFunction(context, objValue2, 2, args);
-                if (!fresult.IsEmpty()) {
-                    auto val = v8::String::Utf8Value(isolate, fresult.ToLocalChecked());
-                    string strResult(*val, val.length());
-                    //InfoLn("Call result: " << strResult.length() << " statTaskNum_="<< statTaskNum_);
-                    if(statTaskNum_ > 0 && (--statTaskNum_ <= 0)) {
-                        std::cout << "all task done!!!!!!!!!!!!!!!!!!! cost=" << (GetMilliSeconds() - statTick_) << std::endl;
-                    }
-                    std::unique_lock<std::mutex> guard(m_mutexResult);
-                    results_.push_back({std::move(callback), std::move(strResult)});
-                }
-                else {
-                    v8::String::Utf8Value utf8Value(isolate, trycatch.Message()->Get());
-                    std::cout << "call function didn't return a value. exception: " << *utf8Value << std::endl;
-                }
-                //检查一下堆栈大小
-                //CheckHeapSize(isolate, index);
+        }
+        else if (ok) {
+            StatTaskDone(batch.size());
+            for (size_t k = 0; k < batch.size(); k++) {
+                PostResult(slot, batch[k], std::move(batchResults[k]));
             }
-
         }
+        else {
+            for (auto& item : batch) {
+                PostResult(slot, item, std::string(), TaskStatus::kError);
+            }
+        }
+        batch.clear();
+        return;
+    }
+    //在这个作用域加handlescope管理v8::Local变量
+    v8::HandleScope handle_scope1(isolate);
+    v8::Local<v8::Value> arg;
+    if (!V8PayloadValue(isolate, locals.context, tu, arg)) {
+        PostResult(slot, tu, std::string(), TaskStatus::kError);
+        return;
+    }
+    v8::TryCatch trycatch(isolate);
+    bool cancelable = (bool)tu.cancel;
+    int64_t tag = BeginBudget(slot, tu.budgetMs ? tu.budgetMs : config_.taskBudgetMs, cancelable);
+    if (cancelable) {
+        //登记运行标记后Cancel才能中断，登记前已取消的直接跳过
+        tu.cancel.state_->runTag.store(tag, std::memory_order_relaxed);
+        tu.cancel.state_->slot.store(&slot, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    v8::Local<v8::Value> fresult;
+    bool called = false;
+    if (!tu.cancel.IsCancelled()) {
+        called = V8Call<v8::Local<v8::Value>>(locals.context, locals.func, locals.recv, 0, arg).To(&fresult);
+    }
+    bool terminated = EndBudget(slot, isolate);
+    if (cancelable) {
+        tu.cancel.state_->slot.store(nullptr, std::memory_order_relaxed);
+    }
+    if (tu.cancel.IsCancelled()) {
+        PostResult(slot, tu, std::string(), TaskStatus::kCancelled);
+    }
+    else if (terminated) {
+        std::cout << "call function over budget, terminated! index=" << index << std::endl;
+        slot.overrunNum++;
+        PostResult(slot, tu, std::string(), TaskStatus::kOverrun);
+    }
+    else if (called) {
+        string strResult;
+        if (!V8ResultString(isolate, fresult, tu.flags, strResult)) {
+            std::cout << "convert call result failed! index=" << index << std::endl;
+            PostResult(slot, tu, std::string(), TaskStatus::kError);
+            return;
+        }
+        //InfoLn("Call result: " << strResult.length() << " statTaskNum_="<< statTaskNum_);
+        StatTaskDone(1);
+        PostResult(slot, tu, std::move(strResult));
     }
     else {
-        std::cout << "not find function! index= " << index << ", " << target_func_name.c_str() << std::endl;
+        v8::String::Utf8Value utf8Value(isolate, trycatch.Message()->Get());
+        std::cout << "call function didn't return a value. exception: " << *utf8Value << std::endl;
+        PostResult(slot, tu, std::string(), TaskStatus::kError);
+    }
+    //检查一下堆栈大小
+    //CheckHeapSize(isolate, index);
+}
+
+void v8engine::V8ExecuteScript(v8::Isolate* isolate, const char* jscode, int index) {
+    v8::Locker locker(isolate);
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    WorkerSlot& slot = *slots_[index];
+    if (!LoadScript(slot, jscode)) {
+        std::cout << "thread done! index=" << index << std::endl;
+        return;
+    }
+    ScriptLocals locals = LocalsOf(isolate, slot.env);
+    v8::Context::Scope context_scope(locals.context);
+    //预热完成，可以加入路由
+    int starting = WorkerSlot::kSlotStarting;
+    if (slot.state.compare_exchange_strong(starting, WorkerSlot::kSlotActive)) {
+        SetSlotState(slot, WorkerSlot::kSlotActive);
+    }
+    //执行任务
+    while (true)
+    {
+        if (shutdown_) {
+            std::cout << "shutdown ntf! index=" << index << std::endl;
+            break;
+        }
+        if (slot.state.load() == WorkerSlot::kSlotRetiring && RetireWorker(slot)) {
+            std::cout << "worker retired! index=" << index << std::endl;
+            break;
+        }
+        if (slot.control.load(std::memory_order_relaxed) != 0) {
+            RunControl(slot);
+        }
+        TaskType tu;
+        if (!PopTask(index, tu)) {
+            NoteIdle(slot, true);
+            if (!SpinTask(slot)) {
+                WaitTask(slot);
+            }
+            continue;
+        }
+        NoteIdle(slot, false);
+        ExecuteTask(slot, locals, tu);
     }
     std::cout << "thread done! index=" << index << std::endl;
 }
 
-bool v8engine::Create(int threadNum, const std::string& script, bool isReboot)
+void v8engine::ServiceSlot(WorkerSlot& slot)
+{
+    v8::Isolate* isolate = slot.isolate;
+    if (isolate == nullptr || slot.env == nullptr) {
+        slot.scheduled.store(false);
+        return;
+    }
+    bool retired = false;
+    {
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        ScriptLocals locals = LocalsOf(isolate, slot.env);
+        v8::Context::Scope context_scope(locals.context);
+        if (slot.state.load() == WorkerSlot::kSlotRetiring) {
+            retired = RetireWorker(slot);
+        }
+        else {
+            if (slot.control.load(std::memory_order_relaxed) != 0) {
+                RunControl(slot);
+            }
+            //最多连续执行poolQuantum个任务，之后让给其他虚拟机
+            TaskType tu;
+            for (int k = 0; k < config_.poolQuantum && !shutdown_ && PopTask(slot.index, tu); k++) {
+                ExecuteTask(slot, locals, tu);
+            }
+        }
+    }
+    if (retired) {
+        //scheduled保持为true，不会再被调度
+        std::cout << "isolate retired! index=" << slot.index << std::endl;
+        DisposeIsolate(slot);
+        SetSlotState(slot, WorkerSlot::kSlotStopped);
+        return;
+    }
+    //先清除调度标记再复查，与ScheduleSlot配对，保证不丢失任务
+    slot.scheduled.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (HasWork(slot)) {
+        ScheduleSlot(slot);
+    }
+}
+
+void v8engine::ScheduleSlot(WorkerSlot& slot)
+{
+    //预热中或已停止的虚拟机不能进入(脚本环境还没准备好或已销毁)，预热完成后StartWorker会调度一次
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int state = slot.state.load();
+    if (state != WorkerSlot::kSlotActive && state != WorkerSlot::kSlotRetiring) {
+        return;
+    }
+    if (slot.scheduled.exchange(true)) {
+        return;
+    }
+    //每个虚拟机最多在就绪队列中出现一次，队列容量为kMaxWorkers，不会满
+    int index = slot.index;
+    while (!ready_.TryPush(std::move(index))) {
+        std::this_thread::yield();
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (poolIdle_.load(std::memory_order_relaxed) > 0) {
+        { std::lock_guard<std::mutex> guard(poolMutex_); }
+        poolCondi_.notify_one();
+    }
+}
+
+void v8engine::PoolLoop(int k)
+{
+    if (!config_.cpuSet.empty()) {
+        PinCurrentThread(config_.cpuSet[k % config_.cpuSet.size()]);
+    }
+    while (!shutdown_) {
+        int i = 0;
+        if (ready_.TryPop(i)) {
+            ServiceSlot(*slots_[i]);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(poolMutex_);
+        poolIdle_++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        poolCondi_.wait(guard, [this]() { return shutdown_ || !ready_.Empty(); });
+        poolIdle_--;
+    }
+    std::cout << "pool thread done! k=" << k << std::endl;
+}
+
+bool v8engine::HasWork(WorkerSlot& slot)
+{
+    return !slot.urgent.Empty() || !slot.tasks.Empty() || !slot.shared.Empty()
+        || slot.edfNum.load(std::memory_order_relaxed) != 0
+        || slot.control.load(std::memory_order_relaxed) != 0
+        || slot.state.load() == WorkerSlot::kSlotRetiring;
+}
+
+bool v8engine::Create(int threadNum, const std::string& script, bool isReboot, const V8EngineConfig& config)
 {
     //初始化数据
     shutdown_ = false;
+    config_ = config;
     //读取js脚本
     jsScript_ = script;
     //初始化v8
     std::cout << "v8engine::Create isReboot=" << isReboot << " threadNum=" << threadNum << std::endl;
     if(!isReboot) {
         this->InitEnv();
-        tasks_.resize(threadNum, std::list<TaskType>());
+        this->OpenResultFd();
+        slots_.resize(kMaxWorkers);
+    }
+    threadNum = std::max(1, std::min(threadNum, kMaxWorkers));
+    //队列容量默认值，多路复用模式的虚拟机多，默认用小队列
+    if (config_.queueCapacity == 0) {
+        config_.queueCapacity = config_.poolThreads > 0 ? kPoolQueueCapacity : kTaskQueueCapacity;
+    }
+    config_.edfWindow = std::max<size_t>(1, std::min(config_.edfWindow, config_.queueCapacity / 2));
+    if (config_.urgentCapacity == 0) {
+        config_.urgentCapacity = std::max<size_t>(config_.queueCapacity / 8, 64);
     }
-    //启动工作线程
+    if (config_.sharedCapacity == 0) {
+        config_.sharedCapacity = config_.queueCapacity;
+    }
+    if (config_.resultCapacity == 0) {
+        config_.resultCapacity = config_.queueCapacity;
+    }
+    //为0时看门狗会空转
+    config_.watchdogIntervalMs = std::max<uint32_t>(config_.watchdogIntervalMs, 1);
+    if (config_.pinThreads && config_.cpuSet.empty()) {
+        config_.cpuSet = DefaultWorkerCpus();
+    }
+    if (!config_.pinThreads) {
+        config_.cpuSet.clear();
+    }
+    //多路复用模式先启动线程池
+    for(int k = 0; k < config_.poolThreads; k++) {
+        pool_.emplace_back([this, k]() { PoolLoop(k); });
+    }
+    //启动工作线程，重启时线程数可以和之前不同
     for(int i = 0; i < threadNum; i++) {
-        std::thread t1([this, i]() {
-            v8::Isolate::CreateParams create_params;
-            // create_params.constraints.set_max_old_generation_size_in_bytes((256*1024*1024));
-            // create_params.constraints.set_max_young_generation_size_in_bytes((128*1024*1024));
-            create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
-            v8::Isolate* isolate = v8::Isolate::New(create_params);
-            V8ExecuteScript(isolate, jsScript_.c_str(), i);
-            isolate->Dispose();
-            delete create_params.array_buffer_allocator;
-        });
-        workers_.push_back(std::move(t1));
+        StartWorker(i);
+    }
+    //脚本加载失败的槽位不能参与路由，直接失败
+    bool ready = true;
+    for(int i = 0; i < threadNum; i++) {
+        ready = WaitWorkerReady(i) && ready;
+    }
+    if (!ready) {
+        std::cout << "v8engine::Create load script failed!" << std::endl;
+        CloseVM();
+        return false;
     }
+    workerNum_.store(threadNum);
+    //重启后线程数变少时，把多出来的槽位里遗留的任务(包括EDF堆里的)迁移过去
+    for(int i = threadNum; i < SlotCount(); i++) {
+        MigrateTasks(*slots_[i], true);
+    }
+    UpdateSpinAllowed();
+    //启动看门狗
+    watchdog_ = std::thread([this]() { WatchdogLoop(); });
     return true;
 }
 
+void v8engine::StartWorker(int i)
+{
+    if (!slots_[i]) {
+        slots_[i].reset(new WorkerSlot(config_));
+        slots_[i]->owner = this;
+        slots_[i]->index = i;
+        if (i >= slotCount_.load()) {
+            slotCount_.store(i + 1, std::memory_order_release);
+        }
+    }
+    WorkerSlot& slot = *slots_[i];
+    if (slot.thread.joinable()) {
+        slot.thread.join();
+    }
+    slot.state.store(WorkerSlot::kSlotStarting);
+    slot.scheduled.store(false);
+    if (config_.poolThreads > 0) {
+        //多路复用模式: 在当前线程创建虚拟机并预热，之后由线程池轮流进入
+        v8::Isolate* isolate = NewIsolate(slot);
+        bool ok = false;
+        {
+            v8::Locker locker(isolate);
+            v8::Isolate::Scope isolate_scope(isolate);
+            v8::HandleScope handle_scope(isolate);
+            ok = LoadScript(slot, jsScript_.c_str());
+        }
+        if (!ok) {
+            DisposeIsolate(slot);
+            SetSlotState(slot, WorkerSlot::kSlotStopped);
+            return;
+        }
+        SetSlotState(slot, WorkerSlot::kSlotActive);
+        //预热期间可能已经有任务入队
+        ScheduleSlot(slot);
+        return;
+    }
+    slot.thread = std::thread([this, i]() {
+        //先绑定再创建isolate，让isolate的堆分配在本节点
+        if (!config_.cpuSet.empty()) {
+            PinCurrentThread(config_.cpuSet[i % config_.cpuSet.size()]);
+        }
+        WorkerSlot& slot = *slots_[i];
+        v8::Isolate* isolate = NewIsolate(slot);
+        V8ExecuteScript(isolate, jsScript_.c_str(), i);
+        DisposeIsolate(slot);
+        SetSlotState(slot, WorkerSlot::kSlotStopped);
+    });
+}
+
+void v8engine::JoinWorker(int i)
+{
+    WorkerSlot& slot = *slots_[i];
+    if (slot.thread.joinable()) {
+        slot.thread.join();
+        return;
+    }
+    std::unique_lock<std::mutex> guard(slot.mutex);
+    slot.condi.wait(guard, [&slot]() {
+        return slot.state.load() == WorkerSlot::kSlotStopped;
+    });
+}
+
+bool v8engine::WaitWorkerReady(int i)
+{
+    WorkerSlot& slot = *slots_[i];
+    std::unique_lock<std::mutex> guard(slot.mutex);
+    slot.condi.wait(guard, [&slot]() {
+        return slot.state.load() != WorkerSlot::kSlotStarting;
+    });
+    return slot.state.load() == WorkerSlot::kSlotActive;
+}
+
+void v8engine::SetSlotState(WorkerSlot& slot, int state)
+{
+    {
+        std::lock_guard<std::mutex> guard(slot.mutex);
+        slot.state.store(state);
+    }
+    slot.condi.notify_all();
+}
+
+bool v8engine::Resize(int threadNum)
+{
+    std::lock_guard<std::mutex> guard(resizeMutex_);
+    threadNum = std::max(1, std::min(threadNum, kMaxWorkers));
+    int cur = workerNum_.load();
+    std::cout << "v8engine::Resize " << cur << " -> " << threadNum << std::endl;
+    if (threadNum > cur) {
+        //先启动并预热新线程，全部就绪后才扩大路由范围
+        for (int i = cur; i < threadNum; i++) {
+            StartWorker(i);
+        }
+        bool ok = true;
+        for (int i = cur; i < threadNum; i++) {
+            ok = WaitWorkerReady(i) && ok;
+        }
+        if (!ok) {
+            std::cout << "v8engine::Resize warm up failed!" << std::endl;
+            for (int i = cur; i < threadNum; i++) {
+                if (slots_[i]->state.load() != WorkerSlot::kSlotStopped) {
+                    SetSlotState(*slots_[i], WorkerSlot::kSlotRetiring);
+                    WakeWorker(*slots_[i]);
+                }
+            }
+            for (int i = cur; i < threadNum; i++) {
+                JoinWorker(i);
+            }
+            return false;
+        }
+        workerNum_.store(threadNum);
+    }
+    else if (threadNum < cur) {
+        //先缩小路由范围，再通知多出来的线程退役，等它们迁出任务后退出
+        workerNum_.store(threadNum);
+        for (int i = threadNum; i < cur; i++) {
+            if (slots_[i]->state.load() != WorkerSlot::kSlotStopped) {
+                SetSlotState(*slots_[i], WorkerSlot::kSlotRetiring);
+                WakeWorker(*slots_[i]);
+            }
+        }
+        for (int i = threadNum; i < cur; i++) {
+            JoinWorker(i);
+        }
+    }
+    return true;
+}
+
+bool v8engine::RetireWorker(WorkerSlot& slot)
+{
+    //多路复用模式下线程池的线程不能阻塞等待，否则目标虚拟机可能没有线程执行而死锁，
+    //迁不出去的任务留到下次调度再试
+    MigrateTasks(slot, config_.poolThreads == 0);
+    //还有生产者在投递或任务没迁完，等它们结束后再检查一遍
+    if (slot.pushers.load() != 0 || !slot.retained.empty() || !slot.urgent.Empty() || !slot.tasks.Empty() || !slot.shared.Empty()) {
+        std::this_thread::yield();
+        return false;
+    }
+    return true;
+}
+
+void v8engine::MigrateTasks(WorkerSlot& slot, bool block)
+{
+    //剩余任务按新的路由重新投递，迁移时忽略拒绝/丢弃策略；一旦有任务迁不出去，之后的都留下，保持原有顺序
+    std::vector<TaskType> retained;
+    retained.swap(slot.retained);
+    for (auto& tu : retained) {
+        if (!slot.retained.empty() || !MigrateTask(tu, block)) {
+            slot.retained.push_back(std::move(tu));
+        }
+    }
+    TaskType tu;
+    for (auto* ring : { &slot.urgent, &slot.tasks, &slot.shared }) {
+        while (ring->TryPop(tu)) {
+            if (!slot.retained.empty() || !MigrateTask(tu, block)) {
+                slot.retained.push_back(std::move(tu));
+            }
+        }
+    }
+    for (auto& item : slot.edfHeap) {
+        if (!slot.retained.empty() || !MigrateTask(item.task, block)) {
+            slot.retained.push_back(std::move(item.task));
+        }
+    }
+    slot.edfHeap.clear();
+    slot.edfNum.store(0, std::memory_order_relaxed);
+}
+
+bool v8engine::MigrateTask(TaskType& tu, bool block)
+{
+    if (block) {
+        PushTaskWithPolicy(std::move(tu), QueuePolicy::kBlock);
+        return true;
+    }
+    WorkerSlot* target = EnterSlot(tu.index);
+    if (target == nullptr) {
+        return false;
+    }
+    TaskRing<TaskType>& ring = target->RingOf(tu);
+    bool pushed = RoomOf(*target, ring) > 0 && ring.TryPush(std::move(tu));
+    target->pushers.fetch_sub(1);
+    if (pushed) {
+        WakeWorker(*target);
+    }
+    return pushed;
+}
+
+//Lamping & Veach的jump consistent hash，桶数增加时key只会移动到新桶
+static int JumpConsistentHash(uint64_t key, int buckets)
+{
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (int)b;
+}
+
+int v8engine::RouteOf(uint32_t index, int n) const
+{
+    if (config_.routeMode == RouteMode::kJumpHash) {
+        return JumpConsistentHash(index, n);
+    }
+    return index % n;
+}
+
+WorkerSlot* v8engine::EnterSlot(uint32_t index)
+{
+    while (true) {
+        int n = workerNum_.load(std::memory_order_acquire);
+        if (n == 0) {
+            //从未创建成功，没有可以投递的线程
+            return nullptr;
+        }
+        int route = RouteOf(index, n);
+        //目标线程已停止(脚本加载失败等)时顺延到下一个运行中的线程；
+        //全部停止(CloseVM之后)时仍放入目标线程的队列，等重启后执行
+        WorkerSlot* stopped = nullptr;
+        for (int k = 0; k < n; k++) {
+            WorkerSlot& slot = *slots_[(route + k) % n];
+            int state = slot.state.load();
+            if (state == WorkerSlot::kSlotStopped && stopped == nullptr) {
+                stopped = &slot;
+            }
+            if (state == WorkerSlot::kSlotStopped || state == WorkerSlot::kSlotRetiring) {
+                continue;
+            }
+            slot.pushers.fetch_add(1);
+            if (slot.state.load() != WorkerSlot::kSlotRetiring) {
+                return &slot;
+            }
+            //与缩容竞争，重新路由
+            slot.pushers.fetch_sub(1);
+        }
+        if (stopped != nullptr) {
+            stopped->pushers.fetch_add(1);
+            if (stopped->state.load() != WorkerSlot::kSlotRetiring) {
+                return stopped;
+            }
+            stopped->pushers.fetch_sub(1);
+        }
+    }
+}
+
 void v8engine::Release()
 {
     //关闭虚拟机
     this->CloseVM();
+    this->CloseResultFd();
     //清理v8资源
     v8::V8::Dispose();
     v8::V8::DisposePlatform();
@@ -218,14 +932,632 @@ void v8engine::Release()
     std::cout << ("v8 engine release!") << std::endl;
 }
 
-void v8engine::PushTask(TaskType&& tu)
+PushResult v8engine::PushTask(TaskType&& tu)
+{
+    return PushTaskWithPolicy(std::move(tu), config_.queuePolicy);
+}
+
+PushResult v8engine::PushTask(TaskType&& tu, TaskHandle& handle)
+{
+    handle = TaskHandle::Make();
+    tu.cancel = handle;
+    PushResult ret = PushTask(std::move(tu));
+    if (ret == PushResult::kRejected) {
+        tu.cancel.Reset();
+        handle.Reset();
+    }
+    return ret;
+}
+
+PushResult v8engine::PushTaskWithPolicy(TaskType&& tu, QueuePolicy policy)
 {
-    std::unique_lock<std::mutex> guard(m_mutex);
-    uint32_t index = std::get<1>(tu);
-    int i = index % tasks_.size();
-    tasks_[i].push_back(std::forward<TaskType>(tu));
+    WorkerSlot* target = EnterSlot(tu.index);
+    if (target == nullptr) {
+        rejectedNum_++;
+        return PushResult::kRejected;
+    }
+    WorkerSlot& slot = *target;
+    TaskRing<TaskType>& ring = slot.RingOf(tu);
+    PushResult ret = PushResult::kOk;
+    //无锁入队，只接触目标线程自己的队列；队列满时按策略处理
+    while (RoomOf(slot, ring) == 0 || !ring.TryPush(std::move(tu))) {
+        if (policy == QueuePolicy::kReject) {
+            slot.pushers.fetch_sub(1);
+            rejectedNum_++;
+            return PushResult::kRejected;
+        }
+        if (policy == QueuePolicy::kDropOldest && DropOldest(slot, ring)) {
+            ret = PushResult::kDroppedOldest;
+            continue;
+        }
+        WaitSpace(slot, ring);
+    }
+    slot.pushers.fetch_sub(1);
     //std::cout << "push task! #str=" << str.length() << ", index= " << index << std::endl;
-    m_condi.notify_all();
+    WakeWorker(slot);
+    if (&ring == &slot.shared && ring.Size() > 1) {
+        WakeThief(slot.index);
+    }
+    return ret;
+}
+
+size_t v8engine::PushTasks(std::vector<TaskType>& tasks)
+{
+    //计数排序，把任务按(目标线程, 队列)排成连续区间，每个线程3个队列: 高优先级、绑定线程、共享
+    size_t n = workerNum_.load(std::memory_order_acquire);
+    if (n == 0) {
+        //从未创建成功，全部还给调用者
+        rejectedNum_ += tasks.size();
+        return tasks.size();
+    }
+    const size_t lanes = 3;
+    auto bucketOf = [this, n](const TaskType& tu) {
+        size_t lane = (tu.flags & kTaskHighPriority) ? 0 : ((tu.flags & kTaskNoAffinity) ? 2 : 1);
+        return RouteOf(tu.index, n) * lanes + lane;
+    };
+    std::vector<size_t> offsets(n * lanes + 1, 0);
+    for (auto& tu : tasks) {
+        offsets[bucketOf(tu) + 1]++;
+    }
+    for (size_t i = 0; i < n * lanes; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    std::vector<TaskType> sorted(tasks.size());
+    std::vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (auto& tu : tasks) {
+        sorted[cursor[bucketOf(tu)]++] = std::move(tu);
+    }
+    tasks.clear();
+    //每个线程的任务一次性预留槽位入队
+    for (size_t b = 0; b < n * lanes; b++) {
+        size_t i = b / lanes;
+        size_t begin = offsets[b];
+        size_t end = offsets[b + 1];
+        if (begin == end) {
+            continue;
+        }
+        WorkerSlot& slot = *slots_[i];
+        slot.pushers.fetch_add(1);
+        int state = slot.state.load();
+        if (state == WorkerSlot::kSlotRetiring || state == WorkerSlot::kSlotStopped) {
+            //与缩容竞争或目标线程已停止，逐个重新路由
+            slot.pushers.fetch_sub(1);
+            for (; begin < end; begin++) {
+                if (PushTask(std::move(sorted[begin])) == PushResult::kRejected) {
+                    tasks.push_back(std::move(sorted[begin]));
+                }
+            }
+            continue;
+        }
+        TaskRing<TaskType>& ring = slot.RingOf(sorted[begin]);
+        while (begin < end) {
+            size_t pushed = ring.TryPushBulk(&sorted[begin], std::min(end - begin, RoomOf(slot, ring)));
+            begin += pushed;
+            if (begin >= end) {
+                break;
+            }
+            if (config_.queuePolicy == QueuePolicy::kReject) {
+                //剩余的任务还给调用者
+                rejectedNum_ += end - begin;
+                for (; begin < end; begin++) {
+                    tasks.push_back(std::move(sorted[begin]));
+                }
+                break;
+            }
+            if (config_.queuePolicy == QueuePolicy::kDropOldest && DropOldest(slot, ring)) {
+                continue;
+            }
+            WaitSpace(slot, ring);
+        }
+        slot.pushers.fetch_sub(1);
+        WakeWorker(slot);
+        if (&ring == &slot.shared && end - offsets[b] > 1) {
+            WakeThief(i);
+        }
+    }
+    return tasks.size();
+}
+
+std::future<std::string> v8engine::Submit(Payload data, uint32_t index, uint32_t flags)
+{
+    std::promise<std::string> promise;
+    std::future<std::string> future = promise.get_future();
+    PushResult ret = Submit(std::move(data), index, [promise = std::move(promise)](TaskStatus status, std::string result) mutable {
+        if (status == TaskStatus::kOk) {
+            promise.set_value(std::move(result));
+        }
+        else {
+            promise.set_exception(std::make_exception_ptr(TaskError(status)));
+        }
+    }, flags);
+    (void)ret;
+    return future;
+}
+
+PushResult v8engine::Submit(Payload data, uint32_t index, TaskCompletion then, uint32_t flags)
+{
+    TaskType tu(std::move(data), index, nullptr, flags);
+    tu.complete = std::move(then);
+    PushResult ret = PushTask(std::move(tu));
+    if (ret == PushResult::kRejected) {
+        //被拒绝时任务没有被移走
+        tu.complete(TaskStatus::kRejected, std::string());
+    }
+    return ret;
+}
+
+size_t v8engine::RoomOf(WorkerSlot& slot, TaskRing<TaskType>& ring)
+{
+    if (!config_.edfOrder || &ring != &slot.tasks) {
+        return ring.Capacity();
+    }
+    size_t used = ring.Size() + slot.edfNum.load(std::memory_order_relaxed);
+    return used < ring.Capacity() ? ring.Capacity() - used : 0;
+}
+
+//EDF时堆只归工作线程访问，这里丢弃的是还在队列里的任务中最旧的，堆里的任务最多edfWindow个，很快会被执行
+bool v8engine::DropOldest(WorkerSlot& slot, TaskRing<TaskType>& ring)
+{
+    TaskType old;
+    if (!ring.TryPop(old)) {
+        return false;
+    }
+    droppedNum_++;
+    PostResult(slot, old, std::string(), TaskStatus::kDropped);
+    return true;
+}
+
+void v8engine::GetStat(V8EngineStat& stat)
+{
+    size_t n = SlotCount();
+    stat.queueDepth.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        stat.queueDepth[i] = slots_[i]->urgent.Size() + slots_[i]->tasks.Size() + slots_[i]->shared.Size() + slots_[i]->edfNum.load(std::memory_order_relaxed);
+    }
+    stat.rejectedNum = rejectedNum_;
+    stat.droppedNum = droppedNum_;
+    stat.expiredNum = expiredNum_;
+    stat.cancelledNum = cancelledNum_;
+    stat.overrunNum.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        stat.overrunNum[i] = slots_[i]->overrunNum;
+    }
+}
+
+void v8engine::PostResult(WorkerSlot& slot, TaskType& tu, std::string&& data, TaskStatus status)
+{
+    if (tu.cancel && !tu.cancel.Finish()) {
+        //执行期间被取消，丢弃结果
+        status = TaskStatus::kCancelled;
+        data.clear();
+    }
+    if (status == TaskStatus::kCancelled) {
+        cancelledNum_++;
+    }
+    if (tu.complete) {
+        //直接在当前线程完成
+        tu.complete(status, std::move(data));
+        return;
+    }
+    ResultType result(std::move(tu.callback), std::move(data), status);
+    if (slot.spilling.load(std::memory_order_acquire) || !slot.results.TryPush(std::move(result))) {
+        //结果队列满了(调用者长时间没有收取)，溢出到链表，加锁后再确认一次(可能刚被收取)
+        std::lock_guard<std::mutex> guard(m_mutexResult);
+        if (slot.spilling.load(std::memory_order_relaxed) || !slot.results.TryPush(std::move(result))) {
+            slot.spilling.store(true, std::memory_order_relaxed);
+            slot.overflow.push_back(std::move(result));
+        }
+    }
+    SignalResult();
+}
+
+void v8engine::SignalResult()
+{
+    if (resultFd_[1] < 0 || resultSignaled_.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    auto n = write(resultFd_[1], &one, resultFd_[0] == resultFd_[1] ? sizeof(one) : 1);
+    (void)n;
+}
+
+void v8engine::OpenResultFd()
+{
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    resultFd_[0] = resultFd_[1] = fd;
+#else
+    if (pipe(resultFd_) != 0) {
+        resultFd_[0] = resultFd_[1] = -1;
+        return;
+    }
+    for (int fd : resultFd_) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (resultFd_[0] < 0) {
+        std::cout << "open result fd failed!" << std::endl;
+    }
+}
+
+void v8engine::CloseResultFd()
+{
+    if (resultFd_[0] >= 0) {
+        close(resultFd_[0]);
+    }
+    if (resultFd_[1] >= 0 && resultFd_[1] != resultFd_[0]) {
+        close(resultFd_[1]);
+    }
+    resultFd_[0] = resultFd_[1] = -1;
+}
+
+bool v8engine::PopTask(int index, TaskType& tu)
+{
+    while (NextTask(index, tu)) {
+        if (tu.cancel && !tu.cancel.Claim()) {
+            //已取消，不执行
+            PostResult(*slots_[index], tu, std::string(), TaskStatus::kCancelled);
+            continue;
+        }
+        if (tu.HasDeadline() && tu.deadline < TaskClock::now()) {
+            //已经过期，执行也没有意义了
+            expiredNum_++;
+            PostResult(*slots_[index], tu, std::string(), TaskStatus::kTimeout);
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool v8engine::NextTask(int index, TaskType& tu)
+{
+    WorkerSlot& slot = *slots_[index];
+    //高优先级连续执行达到上限后，先让普通任务执行一个
+    if (slot.highStreak < config_.highBurst && slot.urgent.TryPop(tu)) {
+        slot.highStreak++;
+        NotifySpace(slot);
+        return true;
+    }
+    bool got = config_.edfOrder ? PopEdfTask(slot, tu) : slot.tasks.TryPop(tu);
+    if (got || slot.shared.TryPop(tu)) {
+        slot.highStreak = 0;
+        NotifySpace(slot);
+        return true;
+    }
+    if (slot.urgent.TryPop(tu)) {
+        NotifySpace(slot);
+        return true;
+    }
+    //自己没活了，从其他线程的共享队列窃取(包括正在退役的线程)
+    size_t n = SlotCount();
+    for (size_t k = 1; k < n; k++) {
+        WorkerSlot& victim = *slots_[(index + k) % n];
+        if (victim.shared.TryPop(tu)) {
+            NotifySpace(victim);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool v8engine::PopEdfTask(WorkerSlot& slot, TaskType& tu)
+{
+    //截止时间早的在堆顶，未设置截止时间的视为无穷晚，相同时按入队顺序
+    auto later = [](const WorkerSlot::EdfItem& a, const WorkerSlot::EdfItem& b) {
+        if (a.deadline != b.deadline) {
+            return a.deadline > b.deadline;
+        }
+        return a.seq > b.seq;
+    };
+    //把队列中的任务搬进堆里，堆的大小不超过edfWindow，避免大量任务离开队列后不受容量约束
+    auto& heap = slot.edfHeap;
+    TaskType item;
+    while (heap.size() < config_.edfWindow && slot.tasks.TryPop(item)) {
+        auto deadline = item.HasDeadline() ? item.deadline : TaskClock::time_point::max();
+        heap.push_back({deadline, slot.edfSeq++, std::move(item)});
+        std::push_heap(heap.begin(), heap.end(), later);
+    }
+    if (heap.empty()) {
+        slot.edfNum.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    std::pop_heap(heap.begin(), heap.end(), later);
+    tu = std::move(heap.back().task);
+    heap.pop_back();
+    slot.edfNum.store(heap.size(), std::memory_order_relaxed);
+    return true;
+}
+
+void v8engine::WakeThief(int busy)
+{
+    //多路复用模式下有任务的虚拟机都在就绪队列中，不需要唤醒窃取者
+    if (config_.poolThreads > 0) {
+        return;
+    }
+    size_t n = SlotCount();
+    for (size_t k = 1; k < n; k++) {
+        WorkerSlot& slot = *slots_[(busy + k) % n];
+        if (slot.sleeping.load(std::memory_order_relaxed)) {
+            {
+                std::lock_guard<std::mutex> guard(slot.mutex);
+                slot.stealHint.store(true, std::memory_order_relaxed);
+            }
+            slot.condi.notify_one();
+            return;
+        }
+    }
+}
+
+void v8engine::WaitTask(WorkerSlot& slot)
+{
+    //先登记休眠再复查队列，与WakeWorker中的内存屏障配对，保证不丢失唤醒
+    std::unique_lock<std::mutex> guard(slot.mutex);
+    slot.sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    slot.condi.wait(guard, [this, &slot]() {
+        return shutdown_ || HasWork(slot) || slot.stealHint.load(std::memory_order_relaxed);
+    } );
+    slot.sleeping.store(false, std::memory_order_relaxed);
+    slot.stealHint.store(false, std::memory_order_relaxed);
+}
+
+static inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+void v8engine::NoteIdle(WorkerSlot& slot, bool idle)
+{
+    if (idle) {
+        if (slot.idleSince == 0) {
+            slot.idleSince = std::chrono::duration_cast<std::chrono::nanoseconds>(TaskClock::now().time_since_epoch()).count();
+        }
+        return;
+    }
+    if (slot.idleSince != 0) {
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(TaskClock::now().time_since_epoch()).count();
+        //权重1/8，长时间空闲(超过1秒)按1秒算，避免偶尔的长间隔把平均值拉得太高
+        int64_t gap = std::min<int64_t>(now - slot.idleSince, 1000000000);
+        slot.idleEwmaNs += (gap - slot.idleEwmaNs) / 8;
+        slot.idleSince = 0;
+    }
+}
+
+bool v8engine::SpinTask(WorkerSlot& slot)
+{
+    if (config_.spinMaxUs == 0 || !spinAllowed_.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    //任务通常在自旋上限内到达时才自旋，自旋时间取平均空闲时长的2倍
+    int64_t maxNs = (int64_t)config_.spinMaxUs * 1000;
+    if (slot.idleEwmaNs > maxNs) {
+        return false;
+    }
+    int64_t spinNs = std::min(maxNs, std::max<int64_t>(slot.idleEwmaNs * 2, 1000));
+    auto deadline = TaskClock::now() + std::chrono::nanoseconds(spinNs);
+    int backoff = 1;
+    while (true) {
+        if (shutdown_ || HasWork(slot)) {
+            return true;
+        }
+        if (TaskClock::now() >= deadline) {
+            return false;
+        }
+        //指数退避，pause次数到上限后让出CPU
+        if (backoff <= 64) {
+            for (int k = 0; k < backoff; k++) {
+                CpuRelax();
+            }
+            backoff <<= 1;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void v8engine::UpdateSpinAllowed()
+{
+    //线程数超过CPU数，或1分钟负载已经超过CPU数，自旋只会抢占其他线程的时间
+    int cpus = std::max(1u, std::thread::hardware_concurrency());
+    bool allowed = workerNum_.load() <= cpus;
+    double load = 0;
+    if (allowed && getloadavg(&load, 1) == 1 && load >= cpus) {
+        allowed = false;
+    }
+    spinAllowed_.store(allowed, std::memory_order_relaxed);
+}
+
+void v8engine::WakeWorker(WorkerSlot& slot)
+{
+    if (config_.poolThreads > 0) {
+        ScheduleSlot(slot);
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (slot.sleeping.load(std::memory_order_relaxed)) {
+        { std::lock_guard<std::mutex> guard(slot.mutex); }
+        slot.condi.notify_one();
+    }
+}
+
+void v8engine::WaitSpace(WorkerSlot& slot, TaskRing<TaskType>& ring)
+{
+    //先唤醒消费者再登记等待，与NotifySpace各有一次全序屏障，不会两边都错过
+    WakeWorker(slot);
+    slot.spaceWaiters.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+        std::unique_lock<std::mutex> lock(slot.spaceMutex);
+        //超时兜底: 退役迁移等不经过NextTask的出队不会通知
+        slot.spaceCondi.wait_for(lock, std::chrono::milliseconds(kSpaceWaitMs), [&] {
+            return RoomOf(slot, ring) > 0 || shutdown_;
+        });
+    }
+    slot.spaceWaiters.fetch_sub(1);
+}
+
+void v8engine::NotifySpace(WorkerSlot& slot)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (slot.spaceWaiters.load(std::memory_order_relaxed) > 0) {
+        { std::lock_guard<std::mutex> guard(slot.spaceMutex); }
+        slot.spaceCondi.notify_all();
+    }
+}
+
+int64_t SteadyMilliSeconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(TaskClock::now().time_since_epoch()).count();
+}
+
+int64_t v8engine::BeginBudget(WorkerSlot& slot, uint32_t budgetMs, bool cancelable)
+{
+    if (budgetMs == 0 && !cancelable) {
+        return 0;
+    }
+    int64_t deadline = budgetMs ? SteadyMilliSeconds() + budgetMs : INT64_MAX;
+    int64_t tag = (++slot.runSeq << 2) | WorkerSlot::kRunBusy;
+    slot.runDeadline.store(deadline, std::memory_order_relaxed);
+    slot.runState.store(tag, std::memory_order_release);
+    return tag;
+}
+
+bool v8engine::EndBudget(WorkerSlot& slot, v8::Isolate* isolate)
+{
+    int64_t cur = slot.runState.load(std::memory_order_relaxed);
+    if ((cur & 3) == WorkerSlot::kRunIdle
+        || ((cur & 3) == WorkerSlot::kRunBusy && slot.runState.compare_exchange_strong(cur, cur - WorkerSlot::kRunBusy))) {
+        return false;
+    }
+    //已经决定终止，等TerminateExecution调用完再撤销，避免终止落到下一个任务上
+    while ((slot.runState.load(std::memory_order_acquire) & 3) != WorkerSlot::kRunTerminated) {
+        std::this_thread::yield();
+    }
+    isolate->CancelTerminateExecution();
+    slot.runState.store(slot.runSeq << 2, std::memory_order_relaxed);
+    return true;
+}
+
+bool v8engine::TerminateRun(WorkerSlot& slot, int64_t busyTag)
+{
+    int64_t expected = busyTag;
+    if (!slot.runState.compare_exchange_strong(expected, busyTag - WorkerSlot::kRunBusy + WorkerSlot::kRunTerminating)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(slot.mutex);
+        if (slot.isolate != nullptr) {
+            slot.isolate->TerminateExecution();
+        }
+    }
+    slot.runState.store(busyTag - WorkerSlot::kRunBusy + WorkerSlot::kRunTerminated, std::memory_order_release);
+    return true;
+}
+
+bool TaskHandle::Cancel(bool interrupt)
+{
+    if (state_ == nullptr) {
+        return false;
+    }
+    int cur = state_->state.load(std::memory_order_acquire);
+    while (cur == TaskCancelState::kPending || cur == TaskCancelState::kRunning) {
+        if (state_->state.compare_exchange_weak(cur, TaskCancelState::kCancelled)) {
+            break;
+        }
+    }
+    if (cur == TaskCancelState::kPending) {
+        //还在队列里，工作线程取到时直接跳过
+        return true;
+    }
+    if (cur != TaskCancelState::kRunning) {
+        return false;
+    }
+    //与工作线程登记运行标记后的内存屏障配对，两边至少有一边能看到对方
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    WorkerSlot* slot = state_->slot.load(std::memory_order_acquire);
+    if (interrupt && slot != nullptr) {
+        slot->owner->TerminateRun(*slot, state_->runTag.load(std::memory_order_relaxed));
+    }
+    return true;
+}
+
+void v8engine::WatchdogLoop()
+{
+    std::unique_lock<std::mutex> lock(watchdogMutex_);
+    int64_t spinCheck = 0;
+    while (!shutdown_) {
+        watchdogCondi_.wait_for(lock, std::chrono::milliseconds(config_.watchdogIntervalMs));
+        int64_t now = SteadyMilliSeconds();
+        //每秒刷新一次是否允许自旋
+        if (now - spinCheck >= 1000) {
+            UpdateSpinAllowed();
+            spinCheck = now;
+        }
+        for (int i = 0; i < SlotCount(); i++) {
+            WorkerSlot* slot = slots_[i].get();
+            int64_t tag = slot->runState.load(std::memory_order_acquire);
+            if ((tag & 3) != WorkerSlot::kRunBusy || slot->runDeadline.load(std::memory_order_relaxed) > now) {
+                continue;
+            }
+            TerminateRun(*slot, tag);
+        }
+    }
+}
+
+void v8engine::ControlInterrupt(v8::Isolate* /*isolate*/, void* data)
+{
+    WorkerSlot* slot = static_cast<WorkerSlot*>(data);
+    slot->owner->RunControl(*slot);
+}
+
+void v8engine::RunControl(WorkerSlot& slot)
+{
+    //取走全部命令，中断和线程循环谁先到谁执行
+    uint32_t cmd = slot.control.exchange(0);
+    if (cmd & kControlShowMem) {
+        V8PrintHeapStats(slot.isolate, slot.index);
+    }
+    if (cmd & kControlGC) {
+        startGC(slot.isolate, slot.index);
+    }
+}
+
+void v8engine::SendControl(uint32_t cmd)
+{
+    for (int i = 0; i < SlotCount(); i++) {
+        WorkerSlot* slot = slots_[i].get();
+        slot->control.fetch_or(cmd);
+        bool alive = false;
+        {
+            std::lock_guard<std::mutex> guard(slot->mutex);
+            if (slot->isolate != nullptr) {
+                slot->isolate->RequestInterrupt(ControlInterrupt, slot);
+                alive = true;
+            }
+        }
+        slot->condi.notify_one();
+        if (config_.poolThreads > 0 && alive) {
+            ScheduleSlot(*slot);
+        }
+    }
+}
+
+void v8engine::StatTaskDone(int num)
+{
+    if(statTaskNum_ <= 0) {
+        return;
+    }
+    int prev = statTaskNum_.fetch_sub(num);
+    if(prev > 0 && prev - num <= 0) {
+        std::cout << "all task done!!!!!!!!!!!!!!!!!!! cost=" << (GetMilliSeconds() - statTick_) << std::endl;
+    }
 }
 
 void v8engine::StartStat(int taskNum)
@@ -271,30 +1603,74 @@ void v8engine::InitEnv()
 
 void v8engine::GarbageCollect()
 {
-    for(size_t i = 1; i <= workers_.size(); i++) {
-        PushTask({std::string("gc"), i, [](string){}});
-    }
+    SendControl(kControlGC);
 }
 
 void v8engine::PrintMemoryInfo()
 {
-    for(size_t i = 1; i <= workers_.size(); i++) {
-        PushTask({std::string("showmem"), i, [](string){}});
-    }
+    SendControl(kControlShowMem);
 }
 
 void v8engine::CloseVM()
 {
 	shutdown_ = true;
-    m_condi.notify_all();
-	for (auto& t : workers_) {
-		t.join();
-	}
-	workers_.clear();
+    std::lock_guard<std::mutex> resizeGuard(resizeMutex_);
+    int n = SlotCount();
+    for (int i = 0; i < n; i++) {
+        { std::lock_guard<std::mutex> guard(slots_[i]->mutex); }
+        slots_[i]->condi.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> guard(watchdogMutex_);
+        watchdogCondi_.notify_one();
+    }
+    for (int i = 0; i < n; i++) {
+        if (slots_[i]->thread.joinable()) {
+            slots_[i]->thread.join();
+        }
+    }
+    //多路复用模式: 线程池退出后由当前线程销毁虚拟机
+    {
+        std::lock_guard<std::mutex> guard(poolMutex_);
+        poolCondi_.notify_all();
+    }
+    for (auto& t : pool_) {
+        t.join();
+    }
+    pool_.clear();
+    int ready = 0;
+    while (ready_.TryPop(ready)) {
+    }
+    for (int i = 0; i < n; i++) {
+        if (slots_[i]->isolate != nullptr) {
+            DisposeIsolate(*slots_[i]);
+            SetSlotState(*slots_[i], WorkerSlot::kSlotStopped);
+        }
+    }
+    if (watchdog_.joinable()) {
+        watchdog_.join();
+    }
 }
 
 void v8engine::GetResult(std::list<ResultType>& listResult)
 {
-    std::unique_lock<std::mutex> guard(m_mutexResult);
-    listResult.swap(results_);
+    //顺序为: 清空fd、清除标记、收取。清除标记前到的结果不会再写fd，但一定能在之后的收取中取到；
+    //清除标记后到的结果会重新写fd。反过来先清标记再清fd，会把新写入的通知一起读掉，之后再也不会通知
+    if (resultSignaled_.load()) {
+        uint64_t buf[8];
+        while (read(resultFd_[0], buf, sizeof(buf)) > 0) {
+        }
+        resultSignaled_.exchange(false);
+    }
+    //每个线程先收取结果队列，再收取溢出的结果(溢出的总是更新的)
+    ResultType result;
+    for (int i = 0; i < SlotCount(); i++) {
+        WorkerSlot& slot = *slots_[i];
+        std::unique_lock<std::mutex> guard(m_mutexResult);
+        while (slot.results.TryPop(result)) {
+            listResult.push_back(std::move(result));
+        }
+        listResult.splice(listResult.end(), slot.overflow);
+        slot.spilling.store(false, std::memory_order_release);
+    }
 }
\ No newline at end of file
@@ -14,27 +14,394 @@
 #include <atomic>
 #include <tuple>
 #include <functional>
+#include <memory>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include "taskqueue.h"
+#include "inplacefunction.h"
+#include "payload.h"
 
 namespace v8 {
     class Isolate;
 }
 
-using TaskType = std::tuple<std::string, uint32_t, std::function<void(std::string)>>;
-using ResultType = std::tuple<std::function<void(std::string)>, std::string>;
+class v8engine;
+struct ScriptEnv;
+struct ScriptLocals;
+struct WorkerSlot;
+
+//任务标记
+enum TaskFlag : uint32_t
+{
+    kTaskNoAffinity = 1 << 0,   //不绑定线程，空闲线程可以从繁忙线程窃取执行
+    kTaskHighPriority = 1 << 1, //高优先级，进入目标线程的高优先级队列，优先执行且不会被窃取
+    kTaskOneByte = 1 << 2,      //数据只含ASCII/Latin-1字符(如base64)，以外部字符串交给js，不复制到v8堆
+    kTaskBinary = 1 << 3,       //数据为原始字节，以Uint8Array交给js，不需要base64编解码；数据被多个任务共享时js拿到的是副本
+    kTaskSerialized = 1 << 4,   //数据为ValueSerializer格式(可用SerialWriter构造)，js收到反序列化后的值，返回值也序列化后作为结果
+};
+
+//控制命令，不经过任务队列，通过WorkerSlot::control下发
+enum ControlCmd : uint32_t
+{
+    kControlGC = 1 << 0,        //执行gc
+    kControlShowMem = 1 << 1,   //打印堆内存信息
+};
+
+using TaskClock = std::chrono::steady_clock;
+
+enum class TaskStatus;
+
+//任务回调，只可移动，捕获不超过48字节时不分配堆内存
+using TaskCallback = InplaceFunction<void(std::string)>;
+using TaskCompletion = InplaceFunction<void(TaskStatus, std::string)>;
+
+//任务取消状态，只有请求了TaskHandle的任务才会分配，由任务和句柄共同引用
+struct TaskCancelState
+{
+    enum { kPending, kRunning, kDone, kCancelled };
+    std::atomic<int> refs{1};
+    std::atomic<int> state{kPending};
+    //单个执行时所在的线程和运行标记(WorkerSlot::runState)，用于中断js
+    std::atomic<WorkerSlot*> slot{nullptr};
+    std::atomic<int64_t> runTag{0};
+};
+
+//任务取消句柄，可以拷贝，所有拷贝引用同一个任务
+class TaskHandle
+{
+public:
+    TaskHandle() = default;
+
+    TaskHandle(const TaskHandle& other) : state_(other.state_)
+    {
+        if (state_ != nullptr) {
+            state_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    TaskHandle(TaskHandle&& other) noexcept : state_(other.state_) { other.state_ = nullptr; }
+
+    TaskHandle& operator=(TaskHandle other) noexcept
+    {
+        std::swap(state_, other.state_);
+        return *this;
+    }
+
+    ~TaskHandle() { Reset(); }
+
+    explicit operator bool() const { return state_ != nullptr; }
+
+    //取消任务: 还没开始执行的任务不再执行；正在执行的任务结果被丢弃，interrupt为true时同时终止js执行
+    //任务都以TaskStatus::kCancelled完成，任务已经完成时返回false
+    bool Cancel(bool interrupt = false);
+
+    bool IsCancelled() const
+    {
+        return state_ != nullptr && state_->state.load(std::memory_order_acquire) == TaskCancelState::kCancelled;
+    }
+
+    void Reset()
+    {
+        if (state_ != nullptr && state_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete state_;
+        }
+        state_ = nullptr;
+    }
+
+private:
+    friend class v8engine;
+
+    static TaskHandle Make()
+    {
+        TaskHandle handle;
+        handle.state_ = new TaskCancelState();
+        return handle;
+    }
+
+    //工作线程开始执行前调用，已被取消返回false
+    bool Claim()
+    {
+        int expected = TaskCancelState::kPending;
+        return state_->state.compare_exchange_strong(expected, TaskCancelState::kRunning);
+    }
+
+    //任务完成时调用，执行期间被取消返回false
+    bool Finish()
+    {
+        int cur = state_->state.load(std::memory_order_acquire);
+        while (cur != TaskCancelState::kCancelled) {
+            if (state_->state.compare_exchange_weak(cur, TaskCancelState::kDone)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    TaskCancelState* state_ = nullptr;
+};
+
+//任务: 参数、路由下标(按V8EngineConfig::routeMode映射到线程)、结果回调
+//只可移动，直接存放在队列槽位里，数据为引用计数的池化内存，稳态下投递/执行一个任务不需要malloc
+struct TaskType
+{
+    TaskType() = default;
+    TaskType(Payload d, uint32_t i, TaskCallback cb, uint32_t f = 0)
+        : data(std::move(d)), index(i), callback(std::move(cb)), flags(f) {}
+
+    TaskType(TaskType&&) = default;
+    TaskType& operator=(TaskType&&) = default;
+
+    //是否设置了截止时间
+    bool HasDeadline() const { return deadline.time_since_epoch().count() != 0; }
+
+    Payload data;
+    uint32_t index = 0;
+    TaskCallback callback;
+    uint32_t flags = 0;
+    //截止时间，默认不设置；过期仍未执行的任务直接以TaskStatus::kTimeout完成
+    TaskClock::time_point deadline{};
+    //执行时间预算(毫秒)，0表示使用V8EngineConfig::taskBudgetMs
+    uint32_t budgetMs = 0;
+    //设置后由工作线程直接完成任务，不再经过GetResult，callback不会被调用
+    TaskCompletion complete;
+    //取消句柄，由PushTask(TaskType&&, TaskHandle&)设置
+    TaskHandle cancel;
+};
+//任务完成状态
+enum class TaskStatus
+{
+    kOk,            //正常执行完成
+    kDropped,       //队列已满，作为最旧的任务被丢弃(kQueueDropOldest)
+    kTimeout,       //开始执行前已超过截止时间，未执行
+    kOverrun,       //执行超出时间预算，被看门狗终止
+    kError,         //js抛出异常或返回值不合法
+    kRejected,      //队列已满，未入队(仅用于Submit)
+    kCancelled,     //通过TaskHandle取消
+};
+
+//Submit返回的future在任务未正常完成时抛出的异常
+class TaskError : public std::runtime_error
+{
+public:
+    explicit TaskError(TaskStatus status)
+        : std::runtime_error("v8engine task failed"), status_(status) {}
+
+    TaskStatus status() const { return status_; }
+
+private:
+    TaskStatus status_;
+};
+
+//任务结果: 回调、js返回值、完成状态
+using ResultType = std::tuple<TaskCallback, std::string, TaskStatus>;
+
+//队列满时的处理策略
+enum class QueuePolicy
+{
+    kBlock,         //阻塞等待工作线程腾出空间
+    kReject,        //直接拒绝，PushTask返回PushResult::kRejected
+    kDropOldest,    //丢弃队列中最旧的任务，其回调以TaskStatus::kDropped完成
+};
+
+//任务路由方式
+enum class RouteMode
+{
+    kModulo,        //index % 线程数，线程数变化时几乎所有index都会换线程
+    kJumpHash,      //一致性哈希(jump hash)，线程数从n变为n+1时只有约1/(n+1)的index换线程
+};
+
+//任务投递结果
+enum class PushResult
+{
+    kOk,            //入队成功
+    kRejected,      //队列已满被拒绝
+    kDroppedOldest, //队列已满，丢弃了最旧的任务后入队
+};
+
+//运行统计
+struct V8EngineStat
+{
+    std::vector<size_t> queueDepth; //每个线程当前排队的任务数
+    uint64_t rejectedNum = 0;       //累计被拒绝的任务数
+    uint64_t droppedNum = 0;        //累计被丢弃的任务数
+    uint64_t expiredNum = 0;        //累计因超过截止时间而未执行的任务数
+    uint64_t cancelledNum = 0;      //累计被取消的任务数
+    std::vector<uint64_t> overrunNum; //每个线程累计超出时间预算被终止的次数
+};
+
+//每个工作线程的任务队列默认容量
+constexpr size_t kTaskQueueCapacity = 16384;
+//多路复用模式下每个虚拟机的任务队列默认容量，虚拟机数量多，队列的槽位在创建时就全部分配并初始化
+constexpr size_t kPoolQueueCapacity = 1024;
+//kBlock策略下生产者等待队列空间的最长时间(毫秒)，超时后重新检查
+constexpr int kSpaceWaitMs = 10;
+
+//引擎配置
+struct V8EngineConfig
+{
+    //批量调用: 大于1时每个线程一次最多取batchSize个任务，
+    //以数组形式一次性交给js的goCallJs.onReceiveBattleRspBatch，返回等长的结果数组
+    int batchSize = 1;
+    //每个线程绑定线程任务队列的容量，向上取整为2的幂；0表示默认值
+    //(kTaskQueueCapacity，多路复用模式下为kPoolQueueCapacity)
+    size_t queueCapacity = 0;
+    //高优先级队列和不绑定线程任务队列的容量，0表示分别为queueCapacity的1/8和queueCapacity
+    size_t urgentCapacity = 0;
+    size_t sharedCapacity = 0;
+    //队列满时的处理策略
+    QueuePolicy queuePolicy = QueuePolicy::kBlock;
+    //绑定线程的任务按截止时间最早优先(EDF)执行，未设置截止时间的排在最后，同截止时间按入队顺序
+    bool edfOrder = false;
+    //EDF时工作线程每次最多从队列搬出edfWindow个任务排序，只在这个窗口内按截止时间优先；
+    //搬出的任务仍计入队列容量，所以队列满的判断和不开启EDF时一致
+    size_t edfWindow = 64;
+    //高优先级队列连续执行多少个任务后，让普通队列执行一个，防止普通任务饿死
+    int highBurst = 8;
+    //每个任务默认的执行时间预算(毫秒)，超出后由看门狗线程终止js执行，0表示不限制
+    uint32_t taskBudgetMs = 0;
+    //看门狗检查间隔(毫秒)，最小为1
+    uint32_t watchdogIntervalMs = 10;
+    //每个线程的结果队列容量，满了以后溢出到加锁的链表，0表示与queueCapacity相同
+    size_t resultCapacity = 0;
+    //任务路由方式，配合Resize使用kJumpHash可以让大部分index保持在原来的线程(js状态和内联缓存不失效)
+    RouteMode routeMode = RouteMode::kModulo;
+    //把工作线程绑定到CPU，isolate的内存优先从该CPU所在的NUMA节点分配
+    bool pinThreads = false;
+    //第i个线程绑定cpuSet[i % cpuSet.size()]，为空时使用DefaultWorkerCpus(每个物理核一个，跨节点轮流)
+    std::vector<int> cpuSet;
+    //队列空时先自旋等待的最长时间(微秒)，实际自旋时间按最近任务到达间隔自适应，0表示不自旋直接休眠
+    //线程数超过CPU数或系统负载过高时自动停止自旋
+    uint32_t spinMaxUs = 50;
+    //多路复用: 大于0时不再为每个虚拟机创建线程，由poolThreads个线程通过v8::Locker轮流进入有任务的虚拟机，
+    //此时Create/Resize的threadNum为虚拟机数，可以远大于线程数；cpuSet用于绑定线程池的线程
+    int poolThreads = 0;
+    //多路复用时每次进入虚拟机最多连续执行的任务数，之后让给其他虚拟机
+    int poolQuantum = 64;
+};
+
+//工作线程私有数据，按缓存行对齐，不同线程的队列互不干扰
+struct alignas(kCacheLineSize) WorkerSlot
+{
+    //各队列容量由Create按V8EngineConfig计算好
+    explicit WorkerSlot(const V8EngineConfig& config)
+        : urgent(config.urgentCapacity), tasks(config.queueCapacity), shared(config.sharedCapacity),
+          results(config.resultCapacity) {}
+
+    //按任务标记选择队列
+    TaskRing<TaskType>& RingOf(const TaskType& tu)
+    {
+        if (tu.flags & kTaskHighPriority) {
+            return urgent;
+        }
+        return (tu.flags & kTaskNoAffinity) ? shared : tasks;
+    }
+
+    //高优先级任务(控制命令、延迟敏感的请求)
+    TaskRing<TaskType> urgent;
+    //绑定本线程的普通任务
+    TaskRing<TaskType> tasks;
+    //不绑定线程的任务，其他空闲线程可以从这里窃取
+    TaskRing<TaskType> shared;
+    //每个线程独立的休眠/唤醒原语，投递任务只唤醒目标线程
+    std::mutex mutex;
+    std::condition_variable condi;
+    std::atomic<bool> sleeping{false};
+    //被唤醒去其他线程窃取任务
+    std::atomic<bool> stealHint{false};
+    //kBlock策略下等待队列腾出空间的生产者，消费者取走任务后看到有人等待才通知
+    std::mutex spaceMutex;
+    std::condition_variable spaceCondi;
+    std::atomic<int> spaceWaiters{0};
+
+    //EDF模式下由本线程从tasks中取出、按截止时间排序的任务堆，只有本线程访问
+    struct EdfItem
+    {
+        TaskClock::time_point deadline;
+        uint64_t seq;
+        TaskType task;
+    };
+    std::vector<EdfItem> edfHeap;
+    uint64_t edfSeq = 0;
+    std::atomic<size_t> edfNum{0};
+    //多路复用模式下退役时目标队列已满、暂时迁不出去的任务，下次调度时重试，只有本线程访问
+    std::vector<TaskType> retained;
+    //连续执行的高优先级任务数，只有本线程访问
+    int highStreak = 0;
+
+    //控制通道: 待执行的ControlCmd位掩码，空闲时由工作线程循环处理，执行js时由中断处理
+    std::atomic<uint32_t> control{0};
+    //本线程的虚拟机，由mutex保护，虚拟机销毁前置空
+    v8::Isolate* isolate = nullptr;
+    v8engine* owner = nullptr;
+    int index = 0;
+
+    //正在执行的任务的预算状态，由看门狗检查；低2位为RunState，高位为执行序号，
+    //终止请求只对指定序号的执行生效，不会误伤之后的任务
+    enum RunState { kRunIdle, kRunBusy, kRunTerminating, kRunTerminated };
+    std::atomic<int64_t> runState{kRunIdle};
+    int64_t runSeq = 0;
+    std::atomic<int64_t> runDeadline{0};
+    std::atomic<uint64_t> overrunNum{0};
+
+    //本线程产生的任务结果，GetResult统一收取
+    TaskRing<ResultType> results;
+    //结果队列满时溢出到这里，由v8engine::m_mutexResult保护；溢出后到GetResult收取前，
+    //新结果都继续放这里，保证同一线程的结果按产生顺序交给调用者
+    std::list<ResultType> overflow;
+    std::atomic<bool> spilling{false};
+
+    //线程状态: 启动中(预热脚本)、运行中、退役中(迁出剩余任务后退出)、已停止
+    enum SlotState { kSlotStopped, kSlotStarting, kSlotActive, kSlotRetiring };
+    std::atomic<int> state{kSlotStopped};
+    //正在向本线程投递任务的生产者数，退役时等它归零才退出
+    std::atomic<int> pushers{0};
+    std::thread thread;
+
+    //空闲等待统计，只有本线程访问: 开始空闲的时间和空闲时长的指数移动平均(纳秒)
+    int64_t idleSince = 0;
+    int64_t idleEwmaNs = 0;
+
+    //脚本上下文和入口函数，由虚拟机所在线程创建和销毁
+    ScriptEnv* env = nullptr;
+    //多路复用模式: 是否已在就绪队列中或正在被某个线程执行，保证同一时间只有一个线程进入
+    std::atomic<bool> scheduled{false};
+};
+
+//最多支持的工作线程数
+constexpr int kMaxWorkers = 256;
 
 class v8engine
 {
+    friend class TaskHandle;
 public:
 
     v8engine() = default;
     ~v8engine() = default;
 
-    bool Create(int threadNum, const std::string& script, bool isReboot);
+    bool Create(int threadNum, const std::string& script, bool isReboot, const V8EngineConfig& config = V8EngineConfig());
 
     void Release();
 
-    //添加任务
-    void PushTask(TaskType&&);
+    //添加任务，队列满时按配置的QueuePolicy处理
+    PushResult PushTask(TaskType&&);
+
+    //添加可取消的任务，入队成功时handle为任务的取消句柄，被拒绝时handle为空
+    PushResult PushTask(TaskType&& tu, TaskHandle& handle);
+
+    //批量添加任务，按线程分组后每个线程只入队一次、唤醒一次，
+    //返回被拒绝的任务数，调用后tasks中只剩下被拒绝的任务
+    size_t PushTasks(std::vector<TaskType>& tasks);
+
+    //提交任务，返回的future由工作线程直接完成，任务未正常完成时future抛出TaskError
+    std::future<std::string> Submit(Payload data, uint32_t index, uint32_t flags = 0);
+
+    //提交任务，完成后在工作线程上直接调用then，可以在then里继续Submit把多次js调用串成流水线
+    //(then里提交时队列策略不宜为kBlock，否则向自己的满队列提交会死锁)
+    PushResult Submit(Payload data, uint32_t index, TaskCompletion then, uint32_t flags = 0);
+
+    //获取运行统计
+    void GetStat(V8EngineStat& stat);
 
     //执行脚本
     void V8ExecuteScript(v8::Isolate* isolate, const char* script, int index);
@@ -51,12 +418,78 @@ public:
     //关闭vm
     void CloseVM();
 
+    //在线调整线程数，新线程预热完成后才加入路由，退役线程把剩余任务迁移给其他线程后退出
+    bool Resize(int threadNum);
+
+    //当前参与路由的线程数
+    int GetThreadNum() const { return workerNum_.load(std::memory_order_acquire); }
+
+    //收取所有线程已完成的结果，追加到listResult，不会阻塞工作线程
     void GetResult(std::list<ResultType>& listResult);
 
+    //结果通知描述符，有待收取的结果时可读，可加入epoll/select与网络事件一起等待，可读后调用GetResult
+    int GetResultFd() const { return resultFd_[0]; }
+
 protected:
+    //创建/销毁槽位的虚拟机和脚本环境
+    v8::Isolate* NewIsolate(WorkerSlot& slot);
+    void DisposeIsolate(WorkerSlot& slot);
+
+    //编译执行脚本并保存入口函数，调用前须已进入虚拟机
+    bool LoadScript(WorkerSlot& slot, const char* script);
+
+    //执行一个任务(批量模式下会再取出后续任务凑成一批)
+    void ExecuteTask(WorkerSlot& slot, const ScriptLocals& locals, TaskType& tu);
+
+    //多路复用模式: 线程池线程循环、进入虚拟机执行一轮任务、把有任务的虚拟机放入就绪队列
+    void PoolLoop(int k);
+    void ServiceSlot(WorkerSlot& slot);
+    void ScheduleSlot(WorkerSlot& slot);
+
+    //槽位是否有待处理的任务、命令或退役请求
+    bool HasWork(WorkerSlot& slot);
+
     //获取系统毫秒
     int64_t GetMilliSeconds();
 
+    //开始执行js前登记时间预算，budgetMs为0时不限制；cancelable为true时即使不限制也登记，以便取消时中断
+    //返回本次执行的运行标记，未登记返回0
+    int64_t BeginBudget(WorkerSlot& slot, uint32_t budgetMs, bool cancelable = false);
+
+    //终止运行标记为busyTag的js执行(看门狗超时或任务取消)，该次执行已结束返回false
+    bool TerminateRun(WorkerSlot& slot, int64_t busyTag);
+
+    //js执行结束后撤销预算，被看门狗终止过返回true，并恢复虚拟机继续执行后续任务
+    bool EndBudget(WorkerSlot& slot, v8::Isolate* isolate);
+
+    //看门狗线程，终止超出时间预算的js执行
+    void WatchdogLoop();
+
+    //执行已下发的控制命令
+    void RunControl(WorkerSlot& slot);
+
+    //RequestInterrupt回调，data为WorkerSlot
+    static void ControlInterrupt(v8::Isolate* isolate, void* data);
+
+    //向所有线程下发控制命令，正在执行js的线程通过RequestInterrupt立即处理
+    void SendControl(uint32_t cmd);
+
+    //投递任务结果
+    void PostResult(WorkerSlot& slot, TaskType& tu, std::string&& data, TaskStatus status = TaskStatus::kOk);
+
+    //队列满时丢弃最旧的任务腾出空间，返回是否丢弃成功
+    bool DropOldest(WorkerSlot& slot, TaskRing<TaskType>& ring);
+
+    //创建/关闭结果通知描述符(linux下为eventfd，其他平台为pipe)
+    void OpenResultFd();
+    void CloseResultFd();
+
+    //通知有新结果，多个结果在被收取前只通知一次
+    void SignalResult();
+
+    //统计完成的任务数
+    void StatTaskDone(int num);
+
     //检查堆栈大小
     void CheckHeapSize(v8::Isolate* isolate, int index);
 
@@ -66,15 +499,102 @@ protected:
     //初始化v8环境，全局只能一次，重启不能重复调用
     void InitEnv();
 
+    //启动第i个工作线程(槽位不存在时创建)
+    void StartWorker(int i);
+
+    //等待第i个工作线程退出(多路复用模式下等待虚拟机销毁)
+    void JoinWorker(int i);
+
+    //等待第i个工作线程预热完成，脚本执行失败返回false
+    bool WaitWorkerReady(int i);
+
+    //设置线程状态并通知等待者
+    void SetSlotState(WorkerSlot& slot, int state);
+
+    //退役线程: 把剩余任务迁移给其他线程，没有剩余任务且没有生产者时返回true
+    bool RetireWorker(WorkerSlot& slot);
+
+    //把一个任务按当前路由迁移到其他线程: block为true时等待目标队列腾出空间(忽略拒绝/丢弃策略)，
+    //否则目标队列满时返回false，任务留在tu中
+    bool MigrateTask(TaskType& tu, bool block);
+
+    //把槽位里剩余的任务(队列、EDF堆、上次没迁完的)全部迁移，block为false时迁不出去的留在retained中
+    void MigrateTasks(WorkerSlot& slot, bool block);
+
+    //按路由方式计算index在n个线程中的目标线程
+    int RouteOf(uint32_t index, int n) const;
+
+    //按当前路由获取目标线程并登记为生产者，避免投递到正在退役的线程；没有工作线程时返回nullptr
+    WorkerSlot* EnterSlot(uint32_t index);
+
+    //按指定策略投递
+    PushResult PushTaskWithPolicy(TaskType&& tu, QueuePolicy policy);
+
+    //队列还能接收的任务数，EDF时要扣除已搬进堆里的任务
+    size_t RoomOf(WorkerSlot& slot, TaskRing<TaskType>& ring);
+
+    //已创建的槽位数(包括退役和停止的)
+    int SlotCount() const { return slotCount_.load(std::memory_order_acquire); }
+
+    //队列为空时休眠，直到有新任务或关闭
+    void WaitTask(WorkerSlot& slot);
+
+    //休眠前自旋等待一段时间(指数退避)，等到新任务返回true
+    bool SpinTask(WorkerSlot& slot);
+
+    //记录空闲时长，用于计算自旋时间
+    void NoteIdle(WorkerSlot& slot, bool idle);
+
+    //按线程数和系统负载判断是否允许自旋，由看门狗定期刷新
+    void UpdateSpinAllowed();
+
+    //唤醒指定线程(仅在其休眠时才加锁通知)
+    void WakeWorker(WorkerSlot& slot);
+
+    //队列满时挂起生产者，直到消费者取走任务或超时
+    void WaitSpace(WorkerSlot& slot, TaskRing<TaskType>& ring);
+
+    //取走任务后通知等待空间的生产者(仅在有人等待时才加锁通知)
+    void NotifySpace(WorkerSlot& slot);
+
+    //目标线程繁忙时，唤醒一个休眠的兄弟线程来窃取不绑定线程的任务
+    void WakeThief(int busy);
+
+    //取任务，已过截止时间的任务直接以kTimeout完成并跳过
+    bool PopTask(int index, TaskType& tu);
+
+    //取下一个任务: 先取高优先级队列，再取自己的普通队列和共享队列，最后从其他线程的共享队列窃取
+    bool NextTask(int index, TaskType& tu);
+
+    //EDF模式下从自己的队列取出最早截止的任务
+    bool PopEdfTask(WorkerSlot& slot, TaskType& tu);
+
 private:
-    std::vector<std::thread> workers_;
-    std::mutex m_mutex;
-    std::condition_variable m_condi;
-    bool shutdown_;
-    std::vector<std::list<TaskType>> tasks_;
+    std::atomic<bool> shutdown_;
+    //创建后大小固定为kMaxWorkers，槽位按需创建且不再释放，生产者可以无锁访问
+    std::vector<std::unique_ptr<WorkerSlot>> slots_;
+    std::atomic<int> slotCount_{0};
+    std::atomic<int> workerNum_{0};
+    std::mutex resizeMutex_;
     std::string jsScript_;
+    V8EngineConfig config_;
     std::atomic<int> statTaskNum_;
     int64_t statTick_;
     std::mutex m_mutexResult;
-    std::list<ResultType> results_;
+    int resultFd_[2] = {-1, -1};
+    std::atomic<bool> resultSignaled_{false};
+    std::atomic<bool> spinAllowed_{false};
+    //多路复用模式的线程池和就绪虚拟机队列
+    std::vector<std::thread> pool_;
+    TaskRing<int> ready_{kMaxWorkers};
+    std::mutex poolMutex_;
+    std::condition_variable poolCondi_;
+    std::atomic<int> poolIdle_{0};
+    std::atomic<uint64_t> rejectedNum_{0};
+    std::atomic<uint64_t> droppedNum_{0};
+    std::atomic<uint64_t> expiredNum_{0};
+    std::atomic<uint64_t> cancelledNum_{0};
+    std::thread watchdog_;
+    std::mutex watchdogMutex_;
+    std::condition_variable watchdogCondi_;
 };